@@ -2,6 +2,11 @@ var ldapbinding = require("./build/default/LDAP");
 
 var Connection = function() {
     var callbacks = {};
+    var inflight = {}; // search key -> msgid of the identical search in flight
+    var groupCache = {}; // lookup key -> { groups: [...], expires: ms }
+    var groupCacheSize = 0;
+    var importCallback = null;
+    var importSource = null; // stream feeding the running import, if any
     var binding = new ldapbinding.LDAPConnection();
     var self = this;
     var querytimeout = 5000;
@@ -18,17 +23,124 @@ var Connection = function() {
     self.DEREF_FINDING = 2;
     self.DEREF_ALWAYS = 3;
 
+    // what a search returns: full entries, a list of DNs, or a count
+    self.SEARCH_ENTRIES = 0;
+    self.SEARCH_DN = 1;
+    self.SEARCH_COUNT = 2;
+
+    // Identical searches issued while one is already in flight share its
+    // msgid and result instead of being sent again.
+    self.coalesceSearches = true;
+    self.coalesced = 0;
+
+    // Deep copy of search data, so callers sharing a search cannot see
+    // each other's changes to it.
+    function copyResult(v) {
+        if (Array.isArray(v)) {
+            return v.map(copyResult);
+        }
+        if (v && typeof(v) == 'object') {
+            var copy = {};
+            Object.keys(v).forEach(function(k) {
+                copy[k] = copyResult(v[k]);
+            });
+            return copy;
+        }
+        return v;
+    }
+
+    // Calls every callback with args (msgid, err, data...), each after the
+    // first with its own copy of the data. A callback that throws does not
+    // keep the others from being called; the first exception is rethrown
+    // once all have run.
+    function deliver(cbs, args) {
+        var thrown = null;
+        // copied up front, before the first caller can touch the data
+        var owns = cbs.map(function(CB, i) {
+            return i === 0 ? args : args.slice(0, 2).concat(args.slice(2).map(copyResult));
+        });
+        cbs.forEach(function(CB, i) {
+            try {
+                CB.apply(null, owns[i]);
+            } catch (e) {
+                thrown = thrown || e;
+            }
+        });
+        if (thrown) {
+            throw thrown;
+        }
+    }
+
+    // Hands the response for msgid to every callback waiting on it.
+    function dispatch(msgid, args) {
+        var pending = callbacks[msgid];
+        if (!pending) {
+            return;
+        }
+        clearTimeout(pending.tm);
+        delete callbacks[msgid];
+        if (pending.key !== undefined && inflight[pending.key] === msgid) {
+            delete inflight[pending.key];
+        }
+        deliver(pending.cbs, args);
+    }
+
+    function coalescedSearch(key, send, CB) {
+        var msgid = inflight[key];
+        // a running import keeps writing, so nothing is joined meanwhile
+        if (self.coalesceSearches && !importCallback &&
+            msgid !== undefined && callbacks[msgid]) {
+            self.coalesced++;
+            callbacks[msgid].cbs.push(CB);
+            return;
+        }
+
+        msgid = send();
+        self.setCallback(msgid, CB);
+        if (callbacks[msgid]) {
+            callbacks[msgid].key = key;
+            inflight[key] = msgid;
+        }
+    }
+
+    // Fails every request still waiting for a response. Their msgids mean
+    // nothing once the LDAP session is gone, and a new session reuses them.
+    function failPending() {
+        var pending = callbacks;
+        callbacks = {};
+        inflight = {};
+        var thrown = null;
+        Object.keys(pending).forEach(function(msgid) {
+            clearTimeout(pending[msgid].tm);
+            try {
+                deliver(pending[msgid].cbs, [+msgid, new Error(-1)]); //Server gone away
+            } catch (e) {
+                thrown = thrown || e;
+            }
+        });
+        if (thrown) {
+            throw thrown;
+        }
+    }
+
     self.setCallback = function(msgid, CB) {
         if (msgid >= 0) {
             totalqueries++;
+            if (callbacks[msgid]) {
+                // a leftover from a request whose answer never came
+                dispatch(msgid, [msgid, new Error(-1)]);
+            }
             if (typeof(CB) == 'function') {
-                callbacks[msgid] = {
-                  cb: CB,
-                  tm: setTimeout(function() {
-                      CB(msgid, new Error(-2)); //Request timed out
-                      delete callbacks[msgid];
-                  }, self.querytimeout || querytimeout)
-                };
+                var pending = { cbs: [CB] };
+                pending.tm = setTimeout(function() {
+                    // only abandon the request this timer was armed for
+                    if (callbacks[msgid] !== pending) {
+                        return;
+                    }
+                    binding.abandon(msgid);
+                    dispatch(msgid, [msgid, new Error(-2)]); //Request timed out
+                }, self.querytimeout || querytimeout);
+                callbacks[msgid] = pending;
             }
         } else {
             // msgid is -1, which means an error. We won't add the callback to the array,
@@ -38,6 +150,8 @@ var Connection = function() {
     };
 
     self.open = function(uri, version) {
+        // the new session starts its msgids over
+        failPending();
         if (arguments.length < 2) {
             return binding.open(uri, 3);
         }
@@ -45,23 +159,252 @@ var Connection = function() {
         return binding.open(uri, version);
     };
 
-    self.search = function(base, scope, filter, attrs, CB) {
-        var msgid = binding.search(base, scope, filter, attrs);
-        self.setCallback(msgid, CB);
+    self.search = function(base, scope, filter, attrs, options, CB) {
+        if (typeof(options) == 'function') {
+            CB = options;
+            options = {};
+        }
+        var key = JSON.stringify(['search', base, scope, filter, attrs, options]);
+        coalescedSearch(key, function() {
+            return binding.search(base, scope, filter, attrs, options);
+        }, CB);
+    };
+
+    // CB(msgid, err, dns) receives the DNs of the matching entries only.
+    self.searchDNs = function(base, scope, filter, CB) {
+        self.search(base, scope, filter, '1.1', { mode: self.SEARCH_DN }, CB);
+    };
+
+    // CB(msgid, err, count) receives the number of matching entries. With
+    // pageOption (a pagedSearch sort) the server's VLV content count is
+    // used, so no entries need to be returned at all.
+    self.searchCount = function(base, scope, filter, pageOption, CB) {
+        if (typeof(pageOption) == 'function') {
+            return self.search(base, scope, filter, '1.1', { mode: self.SEARCH_COUNT }, pageOption);
+        }
+        self.pagedSearch(base, scope, filter, '1.1', {
+            mode: self.SEARCH_COUNT,
+            pageSize: 1,
+            sortString: pageOption.sortString
+        }, CB);
     };
     
     self.searchDeref = function(base, scope, filter, attrs, deref, CB) {
-        var msgid = binding.searchDeref(base, scope, filter, attrs, deref);
-        self.setCallback(msgid, CB);
+        var key = JSON.stringify(['searchDeref', base, scope, filter, attrs, deref]);
+        coalescedSearch(key, function() {
+            return binding.searchDeref(base, scope, filter, attrs, deref);
+        }, CB);
     };
     
     self.pagedSearch = function(base, scope, filter, attrs, pageOption, CB) {
-      var msgid = binding.pagedSearch(base, scope, filter, attrs, pageOption);
-      self.setCallback(msgid, CB);
+      var key = JSON.stringify(['pagedSearch', base, scope, filter, attrs, pageOption]);
+      coalescedSearch(key, function() {
+          return binding.pagedSearch(base, scope, filter, attrs, pageOption);
+      }, CB);
+    };
+
+    // RFC 4515 escaping for a value placed in a search filter.
+    function escapeFilter(value) {
+        return value.replace(/[\\*()\0]/g, function(c) {
+            return '\\' + ('0' + c.charCodeAt(0).toString(16)).slice(-2);
+        });
+    }
+
+    // Resolves the transitive set of groups userDn belongs to. Each nesting
+    // level is expanded breadth first with all of its searches in flight at
+    // once, and the direct parents of every DN are memoized for options.ttl
+    // milliseconds. CB(err, result) receives { groups, depth, cycles,
+    // searches, truncated }.
+    self.resolveGroups = function(userDn, options, CB) {
+        if (typeof(options) == 'function') {
+            CB = options;
+            options = {};
+        }
+        options = options || {};
+
+        // a subtree search from the root DSE finds nothing on most servers
+        if (!options.base) {
+            return process.nextTick(function() {
+                CB(new Error('resolveGroups requires options.base'));
+            });
+        }
+
+        var base = options.base;
+        var groupFilter = options.groupFilter || '(objectClass=groupOfNames)';
+        var memberAttr = options.memberAttr || 'member';
+        var maxDepth = options.maxDepth === undefined ? 10 : options.maxDepth;
+        var ttl = options.ttl === undefined ? 60000 : options.ttl;
+        var cacheLimit = options.cacheSize || 10000;
+
+        if (groupFilter.charAt(0) != '(') {
+            groupFilter = '(' + groupFilter + ')';
+        }
+
+        var result = { groups: [], depth: 0, cycles: [], searches: 0, truncated: false };
+        var via = {}; // lowercased dn -> lowercased dn it was reached from
+        var names = {}; // lowercased dn -> dn as first seen
+        var frontier = [userDn];
+        var failed = false;
+
+        via[userDn.toLowerCase()] = null;
+        names[userDn.toLowerCase()] = userDn;
+
+        function parents(dn, done) {
+            var key = JSON.stringify([base, groupFilter, memberAttr, dn.toLowerCase()]);
+            var cached = groupCache[key];
+            if (cached && cached.expires > Date.now()) {
+                return process.nextTick(function() {
+                    done(null, cached.groups);
+                });
+            }
+
+            result.searches++;
+            var filter = '(&' + groupFilter + '(' + memberAttr + '=' + escapeFilter(dn) + '))';
+            self.searchDNs(base, self.SUBTREE, filter, function(msgid, err, groups) {
+                if (err) {
+                    return done(err);
+                }
+                if (!(key in groupCache)) {
+                    groupCacheSize++;
+                }
+                groupCache[key] = { groups: groups, expires: Date.now() + ttl };
+                if (groupCacheSize > cacheLimit) {
+                    pruneGroupCache(cacheLimit);
+                }
+                done(null, groups);
+            });
+        }
+
+        // True when ancestor lies on the path by which dn was reached.
+        function reachedThrough(dn, ancestor) {
+            for (var k = dn; k !== null; k = via[k]) {
+                if (k === ancestor) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        function cycle(from, to) {
+            var path = [names[to]];
+            for (var k = from; k !== to; k = via[k]) {
+                path.unshift(names[k]);
+            }
+            return path;
+        }
+
+        function level() {
+            if (frontier.length === 0) {
+                return CB(null, result);
+            }
+            if (result.depth >= maxDepth) {
+                return probe();
+            }
+
+            var next = [];
+            var waiting = frontier.length;
+            result.depth++;
+
+            frontier.forEach(function(dn) {
+                var child = dn.toLowerCase();
+                parents(dn, function(err, groups) {
+                    if (failed) {
+                        return;
+                    }
+                    if (err) {
+                        failed = true;
+                        return CB(err, result);
+                    }
+
+                    groups.forEach(function(group) {
+                        var key = group.toLowerCase();
+                        if (key in via) {
+                            if (reachedThrough(child, key)) {
+                                result.cycles.push(cycle(child, key));
+                            }
+                            return;
+                        }
+                        via[key] = child;
+                        names[key] = group;
+                        result.groups.push(group);
+                        next.push(group);
+                    });
+
+                    if (--waiting === 0) {
+                        frontier = next;
+                        level();
+                    }
+                });
+            });
+        }
+
+        // At maxDepth, the result is only truncated if the frontier has
+        // parents that were not found yet; one more lookup tells.
+        function probe() {
+            var waiting = frontier.length;
+
+            frontier.forEach(function(dn) {
+                parents(dn, function(err, groups) {
+                    if (failed) {
+                        return;
+                    }
+                    if (err) {
+                        failed = true;
+                        return CB(err, result);
+                    }
+
+                    groups.forEach(function(group) {
+                        if (!(group.toLowerCase() in via)) {
+                            result.truncated = true;
+                        }
+                    });
+
+                    if (--waiting === 0) {
+                        CB(null, result);
+                    }
+                });
+            });
+        }
+
+        level();
+    };
+
+    // Drops expired memberships, or everything if that is not enough.
+    function pruneGroupCache(limit) {
+        var now = Date.now();
+        groupCacheSize = 0;
+        for (var key in groupCache) {
+            if (groupCache[key].expires <= now) {
+                delete groupCache[key];
+            } else {
+                groupCacheSize++;
+            }
+        }
+        if (groupCacheSize > limit) {
+            self.clearGroupCache();
+        }
+    }
+
+    // Forgets every memoized group membership, e.g. after changing groups.
+    self.clearGroupCache = function() {
+        groupCache = {};
+        groupCacheSize = 0;
     };
 
+    // Returns a VLVCursor scrolling the sorted results of a search.
+    self.vlvCursor = function(base, scope, filter, attrs, options) {
+        return new VLVCursor(self, base, scope, filter, attrs, options);
+    };
+
+    // Called before anything that may change what a search returns, so
+    // searches sent afterwards never join one sent before.
+    function forgetSearches() {
+        inflight = {};
+    }
+
     self.simpleBind = function(binddn, password, CB) {
         var msgid;
+        forgetSearches(); // what is visible depends on who is bound
         if (arguments.length === 0) {
             msgid = binding.simpleBind();
         } else {
@@ -71,20 +414,169 @@ var Connection = function() {
     };
 
     self.add = function(dn, data, CB) {
+        forgetSearches();
         var msgid = binding.add(dn, data);
         return self.setCallback(msgid, CB);
     };
 
     self.remove = function(dn, CB) {
+        forgetSearches();
         var msgid = binding.remove(dn);
         return self.setCallback(msgid, CB);
     };
 
     self.modify = function(dn, data, CB) {
+        forgetSearches();
         var msgid = binding.modify(dn, data);
         return self.setCallback(msgid, CB);
     };
 
+    // source is either a file path or a readable stream of LDIF text.
+    // Records are read as the in-flight window has room for them, so a
+    // stream is paused whenever the binding has enough text to go on.
+    // CB(err, stats) is called once every record read has been answered,
+    // and never before importLDIF returns.
+    self.importLDIF = function(source, options, CB) {
+        if (typeof(options) == 'function') {
+            CB = options;
+            options = {};
+        }
+        options = options || {};
+
+        // only one import may run per connection; claim the slot up front
+        // so a second caller is turned away without disturbing the first
+        if (importCallback) {
+            return importFinished(CB, new Error('An LDIF import is already running'));
+        }
+        importCallback = CB;
+
+        var isPath = (typeof(source) == 'string');
+        forgetSearches();
+        var count;
+
+        if (!isPath) {
+            // chunks are handed over as they are; the binding splits
+            // records on raw bytes, so multi-byte characters survive
+            importSource = {
+                stream: source,
+                ended: false,
+                data: function(chunk) {
+                    source.pause();
+                    binding.importLDIFData(chunk);
+                },
+                end: function() {
+                    importSource.ended = true;
+                    binding.importLDIFEnd();
+                },
+                error: function(err) {
+                    binding.importLDIFEnd(err.message || String(err));
+                }
+            };
+            source.on('data', importSource.data);
+            source.on('end', importSource.end);
+            source.on('error', importSource.error);
+        }
+
+        try {
+            count = binding.importLDIF(isPath ? source : '', isPath,
+                                       options.maxInFlight || 16,
+                                       !!options.continueOnError);
+        } catch (e) {
+            detachImportSource();
+            importCallback = null;
+            return importFinished(CB, e);
+        }
+        if (count < 0) {
+            detachImportSource();
+            importCallback = null;
+            importFinished(CB, new Error(-1));
+        }
+    };
+
+    // The binding may finish an import inside importLDIF() itself, so the
+    // callback is always deferred.
+    function importFinished(CB, err, stats) {
+        process.nextTick(function() {
+            CB(err, stats);
+        });
+    }
+
+    // Stops feeding the binding. A stream the import no longer wants is
+    // destroyed, so it does not sit paused holding its descriptor.
+    function detachImportSource() {
+        var src = importSource;
+        importSource = null;
+        if (src) {
+            src.stream.removeListener('data', src.data);
+            src.stream.removeListener('end', src.end);
+            src.stream.removeListener('error', src.error);
+            if (!src.ended && typeof(src.stream.destroy) == 'function') {
+                src.stream.on('error', function() {});
+                src.stream.destroy();
+            }
+        }
+    }
+
+    // Brings the given attributes of dn to the desired values, sending only
+    // the mods needed. Attributes not named in desired are left alone; an
+    // empty list or null removes the attribute. CB(err, mods) receives the
+    // mods that were sent, which is empty when the entry already matched.
+    self.modifyToMatch = function(dn, desired, options, CB) {
+        if (typeof(options) == 'function') {
+            CB = options;
+            options = {};
+        }
+        options = options || {};
+
+        function isObject(v) {
+            return v !== null && typeof(v) == 'object' && !Array.isArray(v);
+        }
+        if (!isObject(desired) ||
+            (options.currentEntry !== undefined && !isObject(options.currentEntry))) {
+            return process.nextTick(function() {
+                CB(new Error('modifyToMatch needs desired and currentEntry to be objects'));
+            });
+        }
+
+        function diff(current) {
+            var mods;
+            try {
+                mods = binding.diffEntry(current, desired);
+            } catch (e) {
+                return CB(e);
+            }
+            if (mods.length === 0) {
+                return CB(null, mods);
+            }
+            self.modify(dn, mods, function(msgid, err) {
+                CB(err, mods);
+            });
+        }
+
+        if (options.currentEntry) {
+            process.nextTick(function() {
+                diff(options.currentEntry);
+            });
+            return;
+        }
+
+        var attrs = Object.keys(desired).filter(function(attr) {
+            return attr.toLowerCase() != 'dn';
+        });
+        self.search(dn, self.BASE, '(objectClass=*)', attrs.join(',') || '1.1', function(msgid, err, res) {
+            if (err) {
+                return CB(err);
+            }
+            diff(res[0] || {});
+        });
+    };
+
+    // Number of requests sent on this connection that are still waiting
+    // for a response.
+    self.outstanding = function() {
+        return binding.outstanding();
+    };
+
     self.addListener = function(event, CB) {
         binding.addListener(event, CB);
     };
@@ -95,33 +587,205 @@ var Connection = function() {
 
     self.close = function() {
         binding.close();
+        failPending();
     }
 
     binding.addListener("searchresult", function(msgid, result, data, context) {
         // result contains the LDAP response type. It's unused.
-        if (callbacks[msgid]) {
-            clearTimeout(callbacks[msgid].tm);
-            callbacks[msgid].cb(msgid, null, data, context);
-            delete(callbacks[msgid]);
-        }
+        dispatch(msgid, [msgid, null, data, context]);
     });
 
     binding.addListener("result", function(msgid, result) {
         // result contains the LDAP response type. It's unused.
-        if (callbacks[msgid]) {
-            clearTimeout(callbacks[msgid].tm);
-            callbacks[msgid].cb(msgid, null);
-            delete(callbacks[msgid]);
+        dispatch(msgid, [msgid, null]);
+    });
+
+    binding.addListener("disconnected", function() {
+        failPending();
+    });
+
+    binding.addListener("importneed", function() {
+        if (importSource) {
+            importSource.stream.resume();
         }
     });
 
-    binding.addListener("error", function(msgid, err, msg) {
-        if (callbacks[msgid]) {
-            clearTimeout(callbacks[msgid].tm);
-            callbacks[msgid].cb(msgid, new Error(err, msg));
-            delete(callbacks[msgid]);
+    binding.addListener("importdone", function(stats) {
+        var CB = importCallback;
+        importCallback = null;
+        detachImportSource();
+        if (CB) {
+            if (stats.error) {
+                importFinished(CB, new Error(stats.error), stats);
+            } else if (stats.aborted) {
+                var failure = stats.failures[0];
+                importFinished(CB, new Error(failure ? failure.code : -1), stats);
+            } else {
+                importFinished(CB, null, stats);
+            }
         }
     });
+
+    binding.addListener("error", function(msgid, err, msg) {
+        dispatch(msgid, [msgid, new Error(err, msg)]);
+    });
+};
+
+// Scrolls through a sorted search with VLV. Results are fetched and cached
+// in windows of options.windowSize entries; each fetch also brings in the
+// windows on either side (using the VLV before/after counts) so scrolling
+// on is usually served from the cache. At most options.maxWindows windows
+// are kept, and the cache is dropped whenever the server reports a
+// different content count.
+var VLVCursor = function(connection, base, scope, filter, attrs, options) {
+    var self = this;
+    var windows = {};  // window index -> entries
+    var order = [];    // cached window indexes, least recently used first
+    var pending = {};  // window index -> callbacks waiting for it
+
+    options = options || {};
+    var size = options.windowSize || 20;
+    var maxWindows = options.maxWindows || 16;
+    var prefetch = options.prefetch !== false;
+
+    self.count = null;   // content count reported by the server
+    self.context = null; // VLV context ID from the last response
+    self.fetches = 0;    // searches sent
+
+    function touch(k) {
+        var i = order.indexOf(k);
+        if (i >= 0) {
+            order.splice(i, 1);
+        }
+        order.push(k);
+        while (order.length > maxWindows) {
+            delete windows[order.shift()];
+        }
+    }
+
+    function wanted(k) {
+        return k >= 0 && !(k in windows) && !(k in pending) &&
+            (self.count === null || k * size < self.count);
+    }
+
+    // Sends one search covering window k and, when prefetching, any
+    // missing neighbours.
+    function fetch(k) {
+        var before = prefetch && wanted(k - 1) ? size : 0;
+        var after = prefetch && wanted(k + 1) ? 2 * size : size;
+        var requested = [];
+        for (var w = k - before / size; w < k + after / size; w++) {
+            pending[w] = pending[w] || [];
+            requested.push(w);
+        }
+
+        var pageOption = {
+            offset: k * size,
+            pageSize: after,
+            beforeCount: before,
+            sortString: options.sortString
+        };
+        if (self.context) {
+            pageOption.context = self.context;
+        }
+
+        self.fetches++;
+        connection.pagedSearch(base, scope, filter, attrs, pageOption, function(msgid, err, res, context) {
+            if (!err) {
+                if (self.count !== null && context.count !== self.count) {
+                    self.invalidate();
+                }
+                self.count = context.count;
+                if (context.bv_val) {
+                    self.context = context;
+                }
+
+                // position of the first returned entry
+                var start = context.offset - Math.min(before, context.offset);
+                var got = {};
+                requested.forEach(function(w) {
+                    var from = Math.max(0, w * size - start);
+                    var to = Math.max(0, (w + 1) * size - start);
+                    got[w] = windows[w] = res.slice(from, to);
+                    touch(w);
+                });
+            }
+
+            // waiters get the entries themselves, as touch() may already
+            // have evicted their window again
+            requested.forEach(function(w) {
+                var waiting = pending[w];
+                delete pending[w];
+                waiting.forEach(function(CB) {
+                    CB(err, err ? null : got[w]);
+                });
+            });
+        });
+    }
+
+    // Calls CB(err, entries) with the entries of window k.
+    function load(k, CB) {
+        if (k in windows) {
+            var entries = windows[k];
+            touch(k);
+            return process.nextTick(function() { CB(null, entries); });
+        }
+        if (!(k in pending)) {
+            fetch(k);
+        }
+        pending[k].push(CB);
+    }
+
+    // Calls CB(err, entries, count) with up to length entries starting at
+    // the zero-based offset in the sorted list.
+    self.get = function(offset, length, CB) {
+        var first = Math.floor(offset / size);
+        var last = Math.floor((offset + Math.max(length, 1) - 1) / size);
+        var waiting = last - first + 1;
+        var failed = null;
+        var parts = [];
+
+        for (var k = first; k <= last; k++) {
+            load(k, loaded(k - first));
+        }
+
+        // the windows are gathered as they arrive, since a read spanning
+        // more than maxWindows windows evicts its own early ones
+        function loaded(i) {
+            return function(err, entries) {
+                failed = failed || err;
+                parts[i] = entries;
+                if (--waiting > 0) {
+                    return;
+                }
+                if (failed) {
+                    return CB(failed);
+                }
+                done();
+            };
+        }
+
+        function done() {
+            var entries = [].concat.apply([], parts);
+            CB(null, entries.slice(offset - first * size, offset - first * size + length), self.count);
+
+            if (prefetch) {
+                if (wanted(first - 1)) {
+                    load(first - 1, function() {});
+                }
+                if (wanted(last + 1)) {
+                    load(last + 1, function() {});
+                }
+            }
+        }
+    };
+
+    // Drops every cached window.
+    self.invalidate = function() {
+        windows = {};
+        order = [];
+    };
 };
 
 exports.Connection = Connection;
+exports.VLVCursor = VLVCursor;
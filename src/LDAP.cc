@@ -1,9 +1,12 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include <v8.h>
 #include <node.h>
 #include <node_events.h>
+#include <node_buffer.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -18,6 +21,8 @@ static Persistent<String> symbol_search;
 static Persistent<String> symbol_error;
 static Persistent<String> symbol_result;
 static Persistent<String> symbol_unknown;
+static Persistent<String> symbol_importdone;
+static Persistent<String> symbol_importneed;
 
 struct timeval ldap_tv = { 0, 0 }; // static struct used to make ldap_result non-blocking
 
@@ -68,12 +73,774 @@ struct timeval ldap_tv = { 0, 0 }; // static struct used to make ldap_result non
 
 #define NODE_METHOD(n) static Handle<Value> n(const Arguments& args)
 
+// What a search reply is decoded into. Anything but full entries asks the
+// server for no attributes ("1.1") and is remembered per msgid.
+
+#define SEARCH_ENTRIES  0
+#define SEARCH_DN       1
+#define SEARCH_COUNT    2
+
+typedef struct search_mode {
+  int                  msgid;
+  int                  mode;
+  struct search_mode * next;
+} search_mode;
+
+// LDIF import support. Records are parsed one at a time, as the in-flight
+// window has room, into ready-to-send LDAPMod arrays, so the import loop
+// never touches V8 objects and only the records on the wire are held.
+
+#define LDIF_ADD     0
+#define LDIF_MODIFY  1
+#define LDIF_DELETE  2
+#define LDIF_MODRDN  3
+
+typedef struct {
+  int             type;
+  unsigned long   line;         // line number the record starts on
+  char          * dn;
+  LDAPMod      ** mods;
+  int             nmods;
+  char          * newrdn;
+  char          * newsuperior;
+  char          * newdn;        // where a modrdn moves the entry to
+  LDAPControl  ** ctrls;        // sent with the operation
+  int             deleteoldrdn;
+  int             msgid;        // -1 unless the record is in flight
+  int             code;         // LDAP result code once answered
+} ldif_record;
+
+// what ldif_next_record() found in the buffered text
+#define LDIF_NEED_DATA  0
+#define LDIF_GOT_RECORD 1
+#define LDIF_END        2
+#define LDIF_ERROR      -1
+
+#define LDIF_READ_SIZE  65536
+
+typedef struct {
+  unsigned long   line;
+  char          * dn;
+  int             code;
+} ldif_failure;
+
+typedef struct {
+  FILE          * fp;           // NULL when the text is pushed from JS
+  char          * buf;          // text read but not parsed yet
+  size_t          pos;          // start of the unparsed text in buf
+  size_t          len;
+  size_t          cap;
+  int             eof;          // no more text will be appended
+  int             done;         // every record has been read
+  int             waiting;      // importneed emitted, no text since
+  unsigned long   lineno;       // lines consumed so far
+  int             count;        // records read so far
+  ldif_record     pending;      // read, but not sent yet
+  int             haspending;
+  ldif_record   * slots;        // records currently in flight
+  int             inflight;
+  int             maxinflight;
+  int             continueonerror;
+  int             aborted;
+  int             succeeded;
+  int             failed;
+  ldif_failure  * failures;
+  int             nfailures;
+  char            error[512];   // why reading stopped early, if it did
+  struct timeval  started;
+} ldif_import;
+
+static int ldif_b64_value(char c)
+{
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static int ldif_b64_decode(const char * in, struct berval * bv)
+{
+  unsigned int acc = 0;
+  int bits = 0;
+
+  bv->bv_val = (char *) malloc(strlen(in) / 4 * 3 + 4);
+  bv->bv_len = 0;
+
+  for (; *in && *in != '='; in++) {
+    int v = ldif_b64_value(*in);
+    if (v < 0) {
+      if (*in == ' ') continue;
+      free(bv->bv_val);
+      bv->bv_val = NULL;
+      return -1;
+    }
+    acc = ((acc << 6) | v) & 0xffffff;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      bv->bv_val[bv->bv_len++] = (acc >> bits) & 0xff;
+    }
+  }
+  bv->bv_val[bv->bv_len] = '\0';
+
+  return 0;
+}
+
+// Splits "type: value" or "type:: base64" in place. The value is copied
+// into a freshly allocated berval owned by the caller.
+static int ldif_parse_line(char * line, char ** type, struct berval * value)
+{
+  char * colon = strchr(line, ':');
+  char * v;
+
+  if (colon == NULL || colon == line) return -1;
+
+  *colon = '\0';
+  *type = line;
+  v = colon + 1;
+
+  if (*v == ':') {
+    for (v++; *v == ' '; v++);
+    return ldif_b64_decode(v, value);
+  }
+
+  if (*v == '<') return -1; // URL values are not supported
+
+  for (; *v == ' '; v++);
+  value->bv_len = strlen(v);
+  value->bv_val = (char *) malloc(value->bv_len + 1);
+  memcpy(value->bv_val, v, value->bv_len + 1);
+
+  return 0;
+}
+
+static LDAPMod * ldif_new_mod(ldif_record * r, int op, const char * type)
+{
+  LDAPMod * mod = (LDAPMod *) malloc(sizeof(LDAPMod));
+
+  mod->mod_op = op | LDAP_MOD_BVALUES;
+  mod->mod_type = strdup(type);
+  mod->mod_bvalues = NULL;
+
+  r->mods = (LDAPMod **) realloc(r->mods, sizeof(LDAPMod *) * (r->nmods + 2));
+  r->mods[r->nmods++] = mod;
+  r->mods[r->nmods] = NULL;
+
+  return mod;
+}
+
+// Takes ownership of value->bv_val.
+static void ldif_mod_add_value(LDAPMod * mod, struct berval * value)
+{
+  int n = 0;
+
+  if (mod->mod_bvalues != NULL)
+    while (mod->mod_bvalues[n] != NULL) n++;
+
+  mod->mod_bvalues = (struct berval **) realloc(mod->mod_bvalues,
+      sizeof(struct berval *) * (n + 2));
+  mod->mod_bvalues[n] = (struct berval *) malloc(sizeof(struct berval));
+  *(mod->mod_bvalues[n]) = *value;
+  mod->mod_bvalues[n + 1] = NULL;
+}
+
+// True when `dn` names `other` or one of its descendants.
+static int ldif_dn_within(const char * dn, const char * other)
+{
+  size_t len = strlen(dn), olen = strlen(other);
+
+  if (len == olen) return !strcasecmp(dn, other);
+
+  return len > olen && dn[len - olen - 1] == ',' &&
+         !strcasecmp(dn + len - olen, other);
+}
+
+// Returns the DN of the parent of `dn`, or "" for a single RDN.
+static const char * ldif_dn_parent(const char * dn)
+{
+  for (const char * p = dn; *p; p++) {
+    if (*p == '\\' && p[1] != '\0') {
+      p++;
+    } else if (*p == ',') {
+      for (p++; *p == ' '; p++);
+      return p;
+    }
+  }
+  return dn + strlen(dn);
+}
+
+static int ldif_dn_related(const char * a, const char * b)
+{
+  if (a == NULL || b == NULL) return 0;
+  return ldif_dn_within(a, b) || ldif_dn_within(b, a);
+}
+
+// True when two records touch the same entry or one is below the other,
+// counting the new name of a modrdn as well as the old one.
+static int ldif_records_conflict(ldif_record * a, ldif_record * b)
+{
+  return ldif_dn_related(a->dn, b->dn) || ldif_dn_related(a->dn, b->newdn) ||
+         ldif_dn_related(a->newdn, b->dn) || ldif_dn_related(a->newdn, b->newdn);
+}
+
+static void ldif_free_record(ldif_record * r)
+{
+  free(r->dn);
+  free(r->newrdn);
+  free(r->newsuperior);
+  free(r->newdn);
+  ldap_mods_free(r->mods, 1);
+  if (r->ctrls != NULL) ldap_controls_free(r->ctrls);
+  memset(r, 0, sizeof(ldif_record));
+}
+
+// Parses the value of a "control:" line, "oid [true|false] [: value]" or
+// "oid [true|false] [:: base64]", and appends the control to the record.
+static int ldif_parse_control(char * spec, ldif_record * r, const char ** err)
+{
+  LDAPControl * ctrl;
+  char * p = spec, * oid;
+  int n = 0;
+
+  oid = p;
+  while (*p && *p != ' ' && *p != ':') p++;
+  if (p == oid) {
+    *err = "control without an OID";
+    return -1;
+  }
+
+  ctrl = (LDAPControl *) calloc(1, sizeof(LDAPControl));
+  ctrl->ldctl_oid = (char *) malloc(p - oid + 1);
+  memcpy(ctrl->ldctl_oid, oid, p - oid);
+  ctrl->ldctl_oid[p - oid] = '\0';
+
+  if (r->ctrls != NULL)
+    while (r->ctrls[n] != NULL) n++;
+  r->ctrls = (LDAPControl **) realloc(r->ctrls, sizeof(LDAPControl *) * (n + 2));
+  r->ctrls[n] = ctrl;
+  r->ctrls[n + 1] = NULL;
+
+  for (; *p == ' '; p++);
+  if (!strncasecmp(p, "true", 4)) {
+    ctrl->ldctl_iscritical = 1;
+    p += 4;
+  } else if (!strncasecmp(p, "false", 5)) {
+    p += 5;
+  }
+  for (; *p == ' '; p++);
+
+  if (*p == '\0') return 0;
+  if (*p != ':') {
+    *err = "malformed control";
+    return -1;
+  }
+
+  p++;
+  if (*p == ':') {
+    for (p++; *p == ' '; p++);
+    if (ldif_b64_decode(p, &(ctrl->ldctl_value))) {
+      *err = "malformed control value";
+      return -1;
+    }
+  } else if (*p == '<') {
+    *err = "URL control values are not supported";
+    return -1;
+  } else {
+    for (; *p == ' '; p++);
+    ctrl->ldctl_value.bv_len = strlen(p);
+    ctrl->ldctl_value.bv_val = strdup(p);
+  }
+
+  return 0;
+}
+
+// Parses the unfolded lines of a single record. On failure `err` is set;
+// whatever was already attached to `r` is released by ldif_free_record.
+static int ldif_parse_record(char ** lines, int n, ldif_record * r,
+                             const char ** err)
+{
+  struct berval value;
+  LDAPMod * mod = NULL;
+  char * type;
+  int i = 0;
+
+  if (ldif_parse_line(lines[i], &type, &value)) {
+    *err = "malformed dn line";
+    return -1;
+  }
+  if (strcasecmp(type, "dn")) {
+    free(value.bv_val);
+    *err = "record does not start with dn";
+    return -1;
+  }
+  r->dn = value.bv_val;
+
+  for (i++; i < n && !strncasecmp(lines[i], "control:", 8); i++) {
+    int rc;
+    if (ldif_parse_line(lines[i], &type, &value)) {
+      *err = "malformed control";
+      return -1;
+    }
+    rc = ldif_parse_control(value.bv_val, r, err);
+    free(value.bv_val);
+    if (rc) return -1;
+  }
+
+  if (i < n && !strncasecmp(lines[i], "changetype:", 11)) {
+    if (ldif_parse_line(lines[i++], &type, &value)) {
+      *err = "malformed changetype";
+      return -1;
+    }
+    if (!strcasecmp(value.bv_val, "add")) {
+      r->type = LDIF_ADD;
+    } else if (!strcasecmp(value.bv_val, "modify")) {
+      r->type = LDIF_MODIFY;
+    } else if (!strcasecmp(value.bv_val, "delete")) {
+      r->type = LDIF_DELETE;
+    } else if (!strcasecmp(value.bv_val, "modrdn") ||
+               !strcasecmp(value.bv_val, "moddn")) {
+      r->type = LDIF_MODRDN;
+    } else {
+      free(value.bv_val);
+      *err = "unknown changetype";
+      return -1;
+    }
+    free(value.bv_val);
+  }
+
+  switch (r->type) {
+  case LDIF_ADD:
+    for (; i < n; i++) {
+      if (ldif_parse_line(lines[i], &type, &value)) {
+        *err = "malformed attribute line";
+        return -1;
+      }
+      mod = NULL;
+      for (int m = 0; m < r->nmods; m++) {
+        if (!strcasecmp(r->mods[m]->mod_type, type)) mod = r->mods[m];
+      }
+      if (mod == NULL) mod = ldif_new_mod(r, LDAP_MOD_ADD, type);
+      ldif_mod_add_value(mod, &value);
+    }
+    if (r->nmods == 0) {
+      *err = "add record without attributes";
+      return -1;
+    }
+    break;
+
+  case LDIF_MODIFY:
+    for (; i < n; i++) {
+      if (!strcmp(lines[i], "-")) {
+        mod = NULL;
+        continue;
+      }
+      if (ldif_parse_line(lines[i], &type, &value)) {
+        *err = "malformed modify line";
+        return -1;
+      }
+      if (mod == NULL) {
+        int op;
+        if (!strcasecmp(type, "add")) {
+          op = LDAP_MOD_ADD;
+        } else if (!strcasecmp(type, "delete")) {
+          op = LDAP_MOD_DELETE;
+        } else if (!strcasecmp(type, "replace")) {
+          op = LDAP_MOD_REPLACE;
+        } else if (!strcasecmp(type, "increment")) {
+          op = LDAP_MOD_INCREMENT;
+        } else {
+          free(value.bv_val);
+          *err = "unknown modify operation";
+          return -1;
+        }
+        mod = ldif_new_mod(r, op, value.bv_val);
+        free(value.bv_val);
+      } else if (strcasecmp(type, mod->mod_type)) {
+        free(value.bv_val);
+        *err = "attribute does not match modify operation";
+        return -1;
+      } else {
+        ldif_mod_add_value(mod, &value);
+      }
+    }
+    break;
+
+  case LDIF_DELETE:
+    if (i < n) {
+      *err = "unexpected lines in delete record";
+      return -1;
+    }
+    break;
+
+  case LDIF_MODRDN:
+    for (; i < n; i++) {
+      if (ldif_parse_line(lines[i], &type, &value)) {
+        *err = "malformed modrdn line";
+        return -1;
+      }
+      if (!strcasecmp(type, "newrdn") && r->newrdn == NULL) {
+        r->newrdn = value.bv_val;
+      } else if (!strcasecmp(type, "newsuperior") && r->newsuperior == NULL) {
+        r->newsuperior = value.bv_val;
+      } else if (!strcasecmp(type, "deleteoldrdn")) {
+        r->deleteoldrdn = (value.bv_val[0] == '1');
+        free(value.bv_val);
+      } else {
+        free(value.bv_val);
+        *err = "unexpected line in modrdn record";
+        return -1;
+      }
+    }
+    if (r->newrdn == NULL) {
+      *err = "modrdn record without newrdn";
+      return -1;
+    }
+    {
+      const char * parent = r->newsuperior ? r->newsuperior : ldif_dn_parent(r->dn);
+      size_t len = strlen(r->newrdn) + strlen(parent) + 2;
+
+      r->newdn = (char *) malloc(len);
+      if (*parent) {
+        snprintf(r->newdn, len, "%s,%s", r->newrdn, parent);
+      } else {
+        snprintf(r->newdn, len, "%s", r->newrdn);
+      }
+    }
+    break;
+  }
+
+  return 0;
+}
+
+// Parses the text of one record, which holds no blank lines and is
+// unfolded in place. A leading "version:" line is skipped when `first`.
+// Returns 1 when `r` was filled in, 0 when the text held nothing but
+// comments, or -1 with `err` and `errline` set.
+static int ldif_parse(char * buf, unsigned long lineno, int first,
+                      ldif_record * r, const char ** err,
+                      unsigned long * errline)
+{
+  char ** lines = NULL;
+  char * src = buf, * dst = buf, * cur = NULL;
+  unsigned long recline = 0;
+  int nlines = 0, comment = 0, last = 0, rc = 0;
+
+  lineno--;
+  while (!last) {
+    char * eol = strchr(src, '\n');
+    size_t len = eol ? (size_t) (eol - src) : strlen(src);
+
+    last = (eol == NULL);
+    if (len > 0 && src[len - 1] == '\r') len--;
+    lineno++;
+
+    if (len > 0 && src[0] == ' ' && (cur != NULL || comment)) {
+      // folded continuation of the previous line
+      if (!comment) {
+        memmove(dst, src + 1, len - 1);
+        dst += len - 1;
+      }
+    } else {
+      if (cur != NULL) {
+        *dst++ = '\0';
+        lines = (char **) realloc(lines, sizeof(char *) * (nlines + 1));
+        lines[nlines++] = cur;
+        cur = NULL;
+      }
+      comment = 0;
+
+      if (len > 0 && src[0] == '#') {
+        comment = 1;
+      } else if (len > 0) {
+        if (nlines == 0) recline = lineno;
+        cur = dst;
+        memmove(dst, src, len);
+        dst += len;
+      }
+    }
+
+    if (last && cur != NULL) {
+      *dst++ = '\0';
+      lines = (char **) realloc(lines, sizeof(char *) * (nlines + 1));
+      lines[nlines++] = cur;
+      cur = NULL;
+    }
+
+    if (!last) src = eol + 1;
+  }
+
+  memset(r, 0, sizeof(ldif_record));
+  r->type = LDIF_ADD;
+  r->line = recline;
+  r->msgid = -1;
+  r->deleteoldrdn = 1;
+
+  // a leading "version: 1" line belongs to the file, not to a record
+  if (first && nlines > 0 && !strncasecmp(lines[0], "version:", 8)) {
+    if (nlines == 1) {
+      free(lines);
+      return 0;
+    }
+    r->line = recline + 1;
+    rc = ldif_parse_record(lines + 1, nlines - 1, r, err) ? -1 : 1;
+  } else if (nlines > 0) {
+    rc = ldif_parse_record(lines, nlines, r, err) ? -1 : 1;
+  }
+
+  free(lines);
+  if (rc < 0) {
+    *errline = recline;
+    ldif_free_record(r);
+  }
+
+  return rc;
+}
+
+// Cuts the next record out of the buffered text and parses it into `r`.
+// Records end at a blank line, so one is only taken once the blank line
+// (or the end of the input) has been read.
+static int ldif_next_record(ldif_import * imp, ldif_record * r)
+{
+  const char * err = NULL;
+  unsigned long errline = 0;
+
+  for (;;) {
+    char * start = imp->buf + imp->pos, * end = imp->buf + imp->len;
+    char * s = start, * next = NULL;
+    unsigned long lines = 0, first = imp->lineno + 1;
+    int rc;
+
+    while (s < end) {
+      char * eol = (char *) memchr(s, '\n', end - s);
+      size_t len;
+
+      if (eol == NULL) break;
+      lines++;
+      len = eol - s;
+      if (len > 0 && s[len - 1] == '\r') len--;
+      if (len == 0) {
+        next = eol + 1;
+        break;
+      }
+      s = eol + 1;
+    }
+
+    if (next == NULL) {
+      if (!imp->eof) return LDIF_NEED_DATA;
+      if (start == end) return LDIF_END;
+      if (s < end) lines++;
+      s = end;
+      next = end;
+    }
+
+    *s = '\0';
+    imp->pos = next - imp->buf;
+    imp->lineno += lines;
+
+    rc = ldif_parse(start, first, imp->count == 0, r, &err, &errline);
+    if (rc < 0) {
+      snprintf(imp->error, sizeof(imp->error), "LDIF parse error at line %lu: %s",
+               errline, err);
+      return LDIF_ERROR;
+    }
+    if (rc > 0) {
+      imp->count++;
+      return LDIF_GOT_RECORD;
+    }
+  }
+}
+
+// Appends text to the import buffer, first dropping what was parsed.
+static void ldif_append(ldif_import * imp, const char * data, size_t n)
+{
+  if (imp->pos > 0) {
+    memmove(imp->buf, imp->buf + imp->pos, imp->len - imp->pos);
+    imp->len -= imp->pos;
+    imp->pos = 0;
+  }
+  if (imp->len + n + 1 > imp->cap) {
+    imp->cap = imp->len + n + 1;
+    imp->buf = (char *) realloc(imp->buf, imp->cap);
+  }
+  memcpy(imp->buf + imp->len, data, n);
+  imp->len += n;
+  imp->buf[imp->len] = '\0';
+  imp->waiting = 0;
+}
+
+// Reads the next chunk of an imported file.
+static int ldif_read_chunk(ldif_import * imp)
+{
+  char chunk[LDIF_READ_SIZE];
+  size_t n = fread(chunk, 1, sizeof(chunk), imp->fp);
+
+  if (n > 0) {
+    ldif_append(imp, chunk, n);
+  } else if (ferror(imp->fp)) {
+    snprintf(imp->error, sizeof(imp->error), "Cannot read LDIF: %s", strerror(errno));
+    return -1;
+  } else {
+    imp->eof = 1;
+  }
+
+  return 0;
+}
+
+static void ldif_add_failure(ldif_import * imp, ldif_record * r, int code)
+{
+  ldif_failure * f;
+
+  imp->failures = (ldif_failure *) realloc(imp->failures,
+      sizeof(ldif_failure) * (imp->nfailures + 1));
+  f = &(imp->failures[imp->nfailures++]);
+  f->line = r->line;
+  f->dn = strdup(r->dn);
+  f->code = code;
+}
+
+static void ldif_free_import(ldif_import * imp)
+{
+  if (imp->haspending) ldif_free_record(&(imp->pending));
+  for (int i = 0; i < imp->inflight; i++) ldif_free_record(&(imp->slots[i]));
+  for (int i = 0; i < imp->nfailures; i++) free(imp->failures[i].dn);
+  if (imp->fp != NULL) fclose(imp->fp);
+  free(imp->failures);
+  free(imp->slots);
+  free(imp->buf);
+  free(imp);
+}
+
+// Attribute diffing support for DiffEntry().
+
+static int diff_strcmp(const void * a, const void * b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Copies the values of an attribute (an array, a single value, or
+// null/undefined for none) into a sorted C array without duplicates.
+static char ** diff_values(Handle<Value> v, int * n)
+{
+  char ** vals;
+
+  *n = 0;
+  if (v.IsEmpty() || v->IsUndefined() || v->IsNull()) return NULL;
+
+  if (v->IsArray()) {
+    Local<Array> list = Local<Array>::Cast(v);
+    vals = (char **) malloc(sizeof(char *) * (list->Length() + 1));
+    for (unsigned int i = 0; i < list->Length(); i++) {
+      String::Utf8Value val(list->Get(Integer::New(i)));
+      vals[(*n)++] = strdup(*val);
+    }
+  } else {
+    String::Utf8Value val(v);
+    vals = (char **) malloc(sizeof(char *));
+    vals[(*n)++] = strdup(*val);
+  }
+
+  qsort(vals, *n, sizeof(char *), diff_strcmp);
+
+  // an attribute holds each value once, so neither side may repeat one
+  int kept = 0;
+  for (int i = 0; i < *n; i++) {
+    if (kept > 0 && !strcmp(vals[kept - 1], vals[i])) {
+      free(vals[i]);
+    } else {
+      vals[kept++] = vals[i];
+    }
+  }
+  *n = kept;
+
+  return vals;
+}
+
+static void diff_free_values(char ** vals, int n)
+{
+  for (int i = 0; i < n; i++) free(vals[i]);
+  free(vals);
+}
+
+static Local<Object> diff_mod(const char * op, Handle<Value> type,
+                              char ** vals, int n)
+{
+  Local<Object> mod = Object::New();
+  Local<Array> js_vals = Array::New(n);
+
+  for (int i = 0; i < n; i++) {
+    js_vals->Set(Integer::New(i), String::New(vals[i]));
+  }
+  mod->Set(String::New("op"), String::New(op));
+  mod->Set(String::New("type"), type);
+  mod->Set(String::New("vals"), js_vals);
+
+  return mod;
+}
+
+// Builds a dereference control (draft-masarati-ldap-deref) from a spec of
+// the form { member: ['cn', 'mail'], manager: ['cn'] }. Leaves *ctrl NULL
+// when there is nothing to dereference; on failure `err` says why.
+static int deref_create_control(LDAP * ld, Handle<Value> v, LDAPControl ** ctrl,
+                                const char ** err)
+{
+  LDAPDerefSpec * ds;
+  int rc, n;
+
+  *ctrl = NULL;
+  *err = "create deref control failed";
+  if (v.IsEmpty() || !v->IsObject()) return LDAP_SUCCESS;
+
+  Local<Object> spec = Local<Object>::Cast(v);
+  Local<Array> names = spec->GetPropertyNames();
+
+  if ((n = names->Length()) == 0) return LDAP_SUCCESS;
+
+  for (int i = 0; i < n; i++) {
+    if (!spec->Get(names->Get(Integer::New(i)))->IsArray()) {
+      *err = "derefSpec values must be arrays";
+      return LDAP_PARAM_ERROR;
+    }
+  }
+
+  ds = (LDAPDerefSpec *) calloc(n + 1, sizeof(LDAPDerefSpec));
+  for (int i = 0; i < n; i++) {
+    Local<Value> name = names->Get(Integer::New(i));
+    Local<Array> attrs = Local<Array>::Cast(spec->Get(name));
+    String::Utf8Value derefAttr(name);
+    int nattrs = attrs->Length();
+
+    ds[i].derefAttr = strdup(*derefAttr);
+    ds[i].attributes = (char **) malloc(sizeof(char *) * (nattrs + 1));
+    for (int j = 0; j < nattrs; j++) {
+      String::Utf8Value attr(attrs->Get(Integer::New(j)));
+      ds[i].attributes[j] = strdup(*attr);
+    }
+    ds[i].attributes[nattrs] = NULL;
+  }
+
+  rc = ldap_create_deref_control(ld, ds, 0, ctrl);
+
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; ds[i].attributes[j] != NULL; j++) free(ds[i].attributes[j]);
+    free(ds[i].attributes);
+    free(ds[i].derefAttr);
+  }
+  free(ds);
+
+  return rc;
+}
+
 class LDAPConnection : public EventEmitter
 {
 private:
   LDAP  *ld;
   ev_io read_watcher_;
   ev_io write_watcher_;
+  ldif_import *import_;
+  int outstanding_;     // requests sent and not yet answered or abandoned
+  search_mode *modes_;  // searches not returning full entries
 
 public:
   static Persistent<FunctionTemplate> s_ct;
@@ -99,12 +866,20 @@ public:
     NODE_SET_PROTOTYPE_METHOD(s_ct, "rename",       Rename);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "add",          Add);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "remove",          Delete);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "importLDIF",   ImportLDIF);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "importLDIFData", ImportLDIFData);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "importLDIFEnd",  ImportLDIFEnd);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "diffEntry",    DiffEntry);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "abandon",      Abandon);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "outstanding",  Outstanding);
 
     symbol_connected    = NODE_PSYMBOL("connected");
     symbol_disconnected = NODE_PSYMBOL("disconnected");
     symbol_search       = NODE_PSYMBOL("searchresult");
     symbol_error        = NODE_PSYMBOL("error");
     symbol_result       = NODE_PSYMBOL("result");
+    symbol_importdone   = NODE_PSYMBOL("importdone");
+    symbol_importneed   = NODE_PSYMBOL("importneed");
 
     target->Set(String::NewSymbol("LDAPConnection"), s_ct->GetFunction());
   }
@@ -119,6 +894,9 @@ public:
     c->read_watcher_.data = c;
     
     c->ld = NULL;
+    c->import_ = NULL;
+    c->outstanding_ = 0;
+    c->modes_ = NULL;
 
     return args.This();
   }
@@ -162,9 +940,15 @@ public:
       res = ldap_unbind(c->ld);
     }
     c->ld = NULL;
+    c->outstanding_ = 0;
+    c->clearModes();
 
     ev_io_stop(EV_DEFAULT_ &(c->read_watcher_));
 
+    if (c->import_ != NULL) {
+      c->abortImport(LDAP_SERVER_DOWN);
+    }
+
     c->Emit(symbol_disconnected, 0, NULL);
 
     RETURN_INT(0);
@@ -176,8 +960,10 @@ public:
     int fd, msgid;
     char * attrs[255];
     char ** ap;
+    int mode = SEARCH_ENTRIES;
+    LDAPControl *controls[2] = { NULL, NULL };
 
-    //base scope filter attrs
+    //base scope filter attrs [options]
     ENFORCE_ARG_LENGTH(4, "Invalid number of arguments to Search()");
     ENFORCE_ARG_STR(0);
     ENFORCE_ARG_NUMBER(1);
@@ -194,7 +980,17 @@ public:
       RETURN_INT(LDAP_SERVER_DOWN);
     }
 
-    char *bufhead = strdup(*attrs_str);
+    if (args.Length() > 4 && args[4]->IsObject()) {
+      ARG_OBJECT(options, 4);
+      const char * derefErr;
+      mode = options->Get(String::New("mode"))->Int32Value();
+      if (deref_create_control(c->ld, options->Get(String::New("derefSpec")),
+                               &controls[0], &derefErr) != LDAP_SUCCESS) {
+        THROW(derefErr);
+      }
+    }
+
+    char *bufhead = strdup(mode == SEARCH_ENTRIES ? *attrs_str : LDAP_NO_ATTRS);
     char *buf = bufhead;
 
     for (ap = attrs; (*ap = strsep(&buf, " \t,")) != NULL;)
@@ -202,7 +998,15 @@ public:
         if (++ap >= &attrs[255])
           break;
 
-    if ((msgid = ldap_search(c->ld, *base, searchscope, *filter, attrs, 0)) >= 0) {
+    if (controls[0] == NULL) {
+      msgid = ldap_search(c->ld, *base, searchscope, *filter, attrs, 0);
+    } else if (ldap_search_ext(c->ld, *base, searchscope, *filter, attrs, 0, controls, NULL, NULL, 0, &msgid) != LDAP_SUCCESS) {
+      msgid = -1;
+    }
+
+    if (msgid >= 0) {
+      c->outstanding_++;
+      c->setMode(msgid, mode);
       ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
       ev_io_set(&(c->read_watcher_), fd, EV_READ);
       ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -210,6 +1014,10 @@ public:
 
     free(bufhead);
 
+    if (controls[0] != NULL) {
+      ldap_control_free(controls[0]);
+    }
+
     RETURN_INT(msgid);
   }
 
@@ -252,6 +1060,7 @@ public:
     ldap_set_option(c->ld, LDAP_OPT_DEREF, &opt_deref);
     if ((msgid = ldap_search(c->ld, *base, searchscope, *filter, attrs, 0)) >= 0) {
       ldap_set_option(c->ld, LDAP_OPT_DEREF, &opt_deref_default);
+      c->outstanding_++;
       ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
       ev_io_set(&(c->read_watcher_), fd, EV_READ);
       ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -270,10 +1079,11 @@ public:
     char * attrs[255];
     char ** ap;
     struct berval context, *contextPtr = NULL;
-    LDAPControl *controls[3] = { NULL, NULL, NULL }, *sortControl = NULL, *vlvControl = NULL;
+    LDAPControl *controls[4] = { NULL, NULL, NULL, NULL }, *sortControl = NULL, *vlvControl = NULL, *derefControl = NULL;
     Local<Object> contextObj;
     Local<Integer> pageSize;
     Local<Integer> offset;
+    Local<Integer> beforeCount;
     
     //base scope filter attrs
     ENFORCE_ARG_LENGTH(5, "Invalid number of arguments to Search()");
@@ -288,13 +1098,15 @@ public:
     ARG_STR(filter,       2);
     ARG_STR(attrs_str,    3);
     ARG_OBJECT(pageOption,    4);
+
+    int mode = pageOption->Get(String::New("mode"))->Int32Value();
     
     if (c->ld == NULL) {
       c->Emit(symbol_disconnected, 0, NULL);
       RETURN_INT(LDAP_SERVER_DOWN);
     }
     
-    char *bufhead = strdup(*attrs_str);
+    char *bufhead = strdup(mode == SEARCH_ENTRIES ? *attrs_str : LDAP_NO_ATTRS);
     char *buf = bufhead;
     
     for (ap = attrs; (*ap = strsep(&buf, " \t,")) != NULL;)
@@ -323,6 +1135,7 @@ public:
 
     pageSize = Local<Integer>::Cast(pageOption->Get(String::New("pageSize")));
     offset = Local<Integer>::Cast(pageOption->Get(String::New("offset")));
+    beforeCount = Local<Integer>::Cast(pageOption->Get(String::New("beforeCount")));
     // create page control (DEPRECATED: use vlv instead)
     /*
     l_rc = ldap_create_page_control(c->ld, pageSize->IsUndefined() ? 10 : pageSize->Int32Value(), cookiePtr, pagingCriticality, &pageControl);
@@ -331,7 +1144,7 @@ public:
     
     // parse sort keys
     Local<String> _sortString = String::New("cn:caseIgnoreOrderingMatch");
-    if(pageOption->Has(String::New("sortString"))) {
+    if(!pageOption->Get(String::New("sortString"))->IsUndefined()) {
       _sortString = Local<String>::Cast(pageOption->Get(String::New("sortString")));
     }
     
@@ -340,22 +1153,31 @@ public:
     LDAPSortKey **sortKeyList = NULL;
     l_rc = ldap_create_sort_keylist(&sortKeyList, *sortString);
 
-    if(sortKeyList == NULL) THROW(*sortString);
+    if(sortKeyList == NULL) {
+      free(bufhead);
+      free(context.bv_val);
+      THROW(*sortString);
+    }
       
     // create sort control
     l_rc = ldap_create_sort_control(c->ld, sortKeyList, sortCriticality, &sortControl);
     
-    if(l_rc != LDAP_SUCCESS) THROW("create sort control failed");
-    
     // free key list
     ldap_free_sort_keylist(sortKeyList);
+
+    if(l_rc != LDAP_SUCCESS) {
+      free(bufhead);
+      free(context.bv_val);
+      THROW("create sort control failed");
+    }
+    
     controls[ctrlCount++] = sortControl;
     
     LDAPVLVInfo vlvInfo;
     
     vlvInfo.ldvlv_after_count = (pageSize->IsUndefined() ? 10 : pageSize->Int32Value()) - 1;
     vlvInfo.ldvlv_attrvalue = NULL;
-    vlvInfo.ldvlv_before_count = 0;
+    vlvInfo.ldvlv_before_count = beforeCount->IsUndefined() ? 0 : beforeCount->Int32Value();
     vlvInfo.ldvlv_context = contextPtr;
     vlvInfo.ldvlv_count = 0;
     vlvInfo.ldvlv_extradata = NULL;
@@ -364,7 +1186,22 @@ public:
     l_rc = ldap_create_vlv_control(c->ld, &vlvInfo, &vlvControl);
     controls[ctrlCount++] = vlvControl;
 
+    const char * derefErr;
+    l_rc = deref_create_control(c->ld, pageOption->Get(String::New("derefSpec")), &derefControl, &derefErr);
+    if (l_rc != LDAP_SUCCESS) {
+      free(bufhead);
+      free(context.bv_val);
+      if (vlvControl != NULL) ldap_control_free(vlvControl);
+      ldap_control_free(sortControl);
+      THROW(derefErr);
+    }
+    if (derefControl != NULL) {
+      controls[ctrlCount++] = derefControl;
+    }
+
     if (LDAP_SUCCESS == ldap_search_ext(c->ld, *base, searchscope, *filter, attrs, 0, ctrlCount ? controls : NULL, NULL, NULL, 0, &msgid)) {
+      c->outstanding_++;
+      c->setMode(msgid, mode);
       ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
       ev_io_set(&(c->read_watcher_), fd, EV_READ);
       ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -391,6 +1228,10 @@ public:
       ldap_control_free(sortControl);
     }
 
+    if(derefControl != NULL) {
+      ldap_control_free(derefControl);
+    }
+
     RETURN_INT(msgid);
   }
   
@@ -399,6 +1240,7 @@ public:
     HandleScope scope;
     GETOBJ(c);
     int msgid;
+    int fd;
 
     // Validate args. God.
     ENFORCE_ARG_LENGTH(2, "Invaid number of arguments to Modify()");
@@ -462,14 +1304,103 @@ public:
 
     msgid = ldap_modify(c->ld, *dn, ldapmods);
 
+    ldap_mods_free(ldapmods, 1);
+
     if (msgid == LDAP_SERVER_DOWN) {
       c->Emit(symbol_disconnected, 0, NULL);
       RETURN_INT(-1);
     }
 
+    if (msgid >= 0) {
+      c->outstanding_++;
+      ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
+      ev_io_set(&(c->read_watcher_), fd, EV_READ);
+      ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
+    }
+
     RETURN_INT(msgid);
   }
 
+  NODE_METHOD(DiffEntry)
+  {
+    HandleScope scope;
+    Local<Array> mods = Array::New();
+    int nmods = 0;
+
+    // current desired
+    ENFORCE_ARG_LENGTH(2, "Invalid number of arguments to DiffEntry()");
+    ENFORCE_ARG_OBJECT(0);
+    ENFORCE_ARG_OBJECT(1);
+
+    ARG_OBJECT(current, 0);
+    ARG_OBJECT(desired, 1);
+
+    Local<Array> currentNames = current->GetPropertyNames();
+    Local<Array> desiredNames = desired->GetPropertyNames();
+
+    for (unsigned int i = 0; i < desiredNames->Length(); i++) {
+      Local<Value> name = desiredNames->Get(Integer::New(i));
+      Local<Value> currentVals;
+      String::Utf8Value type(name);
+      char ** want, ** have, ** add, ** del;
+      int nwant, nhave, nadd = 0, ndel = 0, w = 0, h = 0;
+
+      if (!strcasecmp(*type, "dn")) continue;
+
+      // attribute names are case insensitive
+      for (unsigned int j = 0; j < currentNames->Length(); j++) {
+        String::Utf8Value currentType(currentNames->Get(Integer::New(j)));
+        if (!strcasecmp(*type, *currentType)) {
+          currentVals = current->Get(currentNames->Get(Integer::New(j)));
+          break;
+        }
+      }
+
+      want = diff_values(desired->Get(name), &nwant);
+      have = diff_values(currentVals, &nhave);
+
+      // both lists are sorted, so one merge pass finds the differences
+      add = (char **) malloc(sizeof(char *) * (nwant + 1));
+      del = (char **) malloc(sizeof(char *) * (nhave + 1));
+      while (w < nwant || h < nhave) {
+        int cmp = w == nwant ? 1 : h == nhave ? -1 : strcmp(want[w], have[h]);
+        if (cmp < 0) {
+          add[nadd++] = want[w++];
+        } else if (cmp > 0) {
+          del[ndel++] = have[h++];
+        } else {
+          w++;
+          h++;
+        }
+      }
+
+      if (nadd == 0 && ndel == 0) {
+        // unchanged
+      } else if (nwant == 0) {
+        mods->Set(Integer::New(nmods++), diff_mod("delete", name, NULL, 0));
+      } else if (nhave == 0) {
+        mods->Set(Integer::New(nmods++), diff_mod("add", name, want, nwant));
+      } else if (nadd + ndel < nwant) {
+        // sending just the changed values is smaller than a replace
+        if (ndel > 0) {
+          mods->Set(Integer::New(nmods++), diff_mod("delete", name, del, ndel));
+        }
+        if (nadd > 0) {
+          mods->Set(Integer::New(nmods++), diff_mod("add", name, add, nadd));
+        }
+      } else {
+        mods->Set(Integer::New(nmods++), diff_mod("replace", name, want, nwant));
+      }
+
+      free(add);
+      free(del);
+      diff_free_values(want, nwant);
+      diff_free_values(have, nhave);
+    }
+
+    return scope.Close(mods);
+  }
+
   NODE_METHOD(Add)
   {
     HandleScope scope;
@@ -526,6 +1457,7 @@ public:
     ldapmods[numOfAttrs] = NULL;
 
     msgid = ldap_add(c->ld, *dn, ldapmods);
+    if (msgid >= 0) c->outstanding_++;
     ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
     ev_io_set(&(c->read_watcher_), fd, EV_READ);
     ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -547,6 +1479,10 @@ public:
     int msgid;
     char * dn = NULL;
 
+    if (c->ld == NULL) {
+      RETURN_INT(LDAP_SERVER_DOWN);
+    }
+
     if (args.Length() > 0) {
       // this is NOT an anonymous bind
       ENFORCE_ARG_LENGTH(1, "Invalid number of arguments to Delete()");
@@ -555,14 +1491,11 @@ public:
       
       dn = strdup(*j_dn);
     }
-    
-    if (c->ld == NULL) {
-      RETURN_INT(LDAP_SERVER_DOWN);
-    }
 
     if ((msgid = ldap_delete(c->ld, dn)) == LDAP_SERVER_DOWN) {
       c->Emit(symbol_disconnected, 0, NULL);
     } else {
+      if (msgid >= 0) c->outstanding_++;
       ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);    
       ev_io_set(&(c->read_watcher_), fd, EV_READ);
       ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -596,11 +1529,13 @@ public:
       RETURN_INT(LDAP_SERVER_DOWN);
     }
 
-    if ((msgid = ldap_modrdn(c->ld, *dn, *newrdn) == LDAP_SERVER_DOWN)) {
+    if ((msgid = ldap_modrdn(c->ld, *dn, *newrdn)) == LDAP_SERVER_DOWN) {
       c->Emit(symbol_disconnected, 0, NULL);
       RETURN_INT(LDAP_SERVER_DOWN);
     }
 
+    if (msgid >= 0) c->outstanding_++;
+
     ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);
     ev_io_set(&(c->read_watcher_), fd, EV_READ);
     ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -637,6 +1572,7 @@ public:
     if ((msgid = ldap_simple_bind(c->ld, binddn, password)) == LDAP_SERVER_DOWN) {
       c->Emit(symbol_disconnected, 0, NULL);
     } else {
+      if (msgid >= 0) c->outstanding_++;
       ldap_get_option(c->ld, LDAP_OPT_DESC, &fd);    
       ev_io_set(&(c->read_watcher_), fd, EV_READ);
       ev_io_start(EV_DEFAULT_ &(c->read_watcher_));
@@ -648,6 +1584,436 @@ public:
     RETURN_INT(msgid);
   }
 
+  NODE_METHOD(Abandon)
+  {
+    HandleScope scope;
+    GETOBJ(c);
+    int rc;
+
+    ENFORCE_ARG_LENGTH(1, "Invalid number of arguments to Abandon()");
+    ENFORCE_ARG_NUMBER(0);
+    ARG_INT(msgid, 0);
+
+    if (c->ld == NULL) {
+      RETURN_INT(LDAP_SERVER_DOWN);
+    }
+
+    // lets libldap drop the request, and any late response, right away
+    if ((rc = ldap_abandon_ext(c->ld, msgid, NULL, NULL)) == LDAP_SUCCESS &&
+        c->outstanding_ > 0) {
+      c->outstanding_--;
+    }
+    c->takeMode(msgid);
+
+    RETURN_INT(rc);
+  }
+
+  NODE_METHOD(Outstanding)
+  {
+    HandleScope scope;
+    GETOBJ(c);
+
+    RETURN_INT(c->outstanding_);
+  }
+
+  NODE_METHOD(ImportLDIF)
+  {
+    HandleScope scope;
+    GETOBJ(c);
+    ldif_import * imp;
+    char errbuf[512];
+    FILE * fp = NULL;
+
+    // source isPath maxInFlight continueOnError
+    ENFORCE_ARG_LENGTH(4, "Invalid number of arguments to ImportLDIF()");
+    ENFORCE_ARG_STR(0);
+    ENFORCE_ARG_BOOL(1);
+    ENFORCE_ARG_NUMBER(2);
+    ENFORCE_ARG_BOOL(3);
+
+    ARG_STR(source,           0);
+    ARG_BOOL(ispath,          1);
+    ARG_INT(maxinflight,      2);
+    ARG_BOOL(continueonerror, 3);
+
+    if (c->import_ != NULL) THROW("An LDIF import is already running");
+
+    if (c->ld == NULL) {
+      c->Emit(symbol_disconnected, 0, NULL);
+      RETURN_INT(-1);
+    }
+
+    if (ispath && (fp = fopen(*source, "rb")) == NULL) {
+      snprintf(errbuf, sizeof(errbuf), "Cannot read %s: %s", *source, strerror(errno));
+      THROW(errbuf);
+    }
+
+    imp = (ldif_import *) calloc(1, sizeof(ldif_import));
+    imp->fp = fp;
+    imp->maxinflight = maxinflight > 0 ? maxinflight : 1;
+    imp->slots = (ldif_record *) calloc(imp->maxinflight, sizeof(ldif_record));
+    imp->continueonerror = continueonerror;
+    gettimeofday(&(imp->started), NULL);
+
+    // without a path, source is the first of the text; the rest is pushed
+    // with importLDIFData() as importneed asks for it
+    ldif_append(imp, ispath ? "" : *source, ispath ? 0 : source.length());
+
+    c->import_ = imp;
+    c->pumpImport();
+
+    RETURN_INT(0);
+  }
+
+  NODE_METHOD(ImportLDIFData)
+  {
+    HandleScope scope;
+    GETOBJ(c);
+
+    ENFORCE_ARG_LENGTH(1, "Invalid number of arguments to ImportLDIFData()");
+
+    if (c->import_ == NULL || c->import_->fp != NULL) {
+      THROW("No LDIF import is waiting for data");
+    }
+
+    if (Buffer::HasInstance(args[0])) {
+      Local<Object> data = args[0]->ToObject();
+      ldif_append(c->import_, Buffer::Data(data), Buffer::Length(data));
+    } else {
+      ARG_STR(data, 0);
+      ldif_append(c->import_, *data, data.length());
+    }
+
+    c->pumpImport();
+
+    RETURN_INT(0);
+  }
+
+  // Marks the end of the pushed text. With an error message the import
+  // stops instead, as if the text had been malformed there.
+  NODE_METHOD(ImportLDIFEnd)
+  {
+    HandleScope scope;
+    GETOBJ(c);
+
+    if (c->import_ == NULL || c->import_->fp != NULL) {
+      THROW("No LDIF import is waiting for data");
+    }
+
+    c->import_->eof = 1;
+    if (args.Length() > 0 && args[0]->IsString()) {
+      ARG_STR(error, 0);
+      snprintf(c->import_->error, sizeof(c->import_->error), "%s", *error);
+      c->import_->aborted = 1;
+    }
+
+    c->pumpImport();
+
+    RETURN_INT(0);
+  }
+
+  // Keeps up to maxinflight import records outstanding, reading more as
+  // the window opens up, and reports the import once nothing is left to
+  // send or wait for.
+  void pumpImport()
+  {
+    ldif_import * imp = import_;
+    int rc = LDAP_SUCCESS, msgid, fd, need = 0;
+
+    while (!imp->aborted && imp->inflight < imp->maxinflight) {
+      ldif_record * r = &(imp->pending);
+      int blocked = 0;
+
+      if (!imp->haspending) {
+        rc = ldif_next_record(imp, r);
+        if (rc == LDIF_NEED_DATA) {
+          if (imp->fp == NULL) {
+            need = !imp->waiting;
+            imp->waiting = 1;
+            break;
+          }
+          if (ldif_read_chunk(imp)) imp->aborted = 1;
+          continue;
+        }
+        if (rc == LDIF_END) {
+          imp->done = 1;
+          break;
+        }
+        if (rc == LDIF_ERROR) {
+          imp->aborted = 1;
+          break;
+        }
+        imp->haspending = 1;
+      }
+
+      // records touching the same entry or its parent/children are kept in
+      // file order, as the server may run pipelined requests in any order
+      for (int i = 0; i < imp->inflight && !blocked; i++) {
+        blocked = ldif_records_conflict(r, &(imp->slots[i]));
+      }
+      if (blocked) break;
+
+      switch (r->type) {
+      case LDIF_ADD:
+        rc = ldap_add_ext(ld, r->dn, r->mods, r->ctrls, NULL, &msgid);
+        break;
+      case LDIF_MODIFY:
+        rc = ldap_modify_ext(ld, r->dn, r->mods, r->ctrls, NULL, &msgid);
+        break;
+      case LDIF_DELETE:
+        rc = ldap_delete_ext(ld, r->dn, r->ctrls, NULL, &msgid);
+        break;
+      case LDIF_MODRDN:
+        rc = ldap_rename(ld, r->dn, r->newrdn, r->newsuperior,
+                         r->deleteoldrdn, r->ctrls, NULL, &msgid);
+        break;
+      }
+
+      imp->haspending = 0;
+
+      if (rc != LDAP_SUCCESS) {
+        ldif_add_failure(imp, r, rc);
+        ldif_free_record(r);
+        imp->failed++;
+        if (rc == LDAP_SERVER_DOWN || !imp->continueonerror) {
+          imp->aborted = 1;
+        }
+        continue;
+      }
+
+      // the slot takes over the record's allocations
+      r->msgid = msgid;
+      imp->slots[imp->inflight++] = *r;
+      memset(r, 0, sizeof(ldif_record));
+      outstanding_++;
+    }
+
+    if (imp->inflight > 0) {
+      ldap_get_option(ld, LDAP_OPT_DESC, &fd);
+      ev_io_set(&read_watcher_, fd, EV_READ);
+      ev_io_start(EV_DEFAULT_ &read_watcher_);
+    } else if (imp->aborted || imp->done) {
+      finishImport();
+      return;
+    }
+
+    // last, as the listener may push more text straight back in
+    if (need) Emit(symbol_importneed, 0, NULL);
+  }
+
+  // Returns 1 if msgid belonged to the running import.
+  int importResult(int msgid, int error)
+  {
+    ldif_import * imp = import_;
+
+    if (imp == NULL) return 0;
+
+    for (int i = 0; i < imp->inflight; i++) {
+      ldif_record * r = &(imp->slots[i]);
+      if (r->msgid != msgid) continue;
+
+      if (error) {
+        ldif_add_failure(imp, r, error);
+        imp->failed++;
+        if (!imp->continueonerror) imp->aborted = 1;
+      } else {
+        imp->succeeded++;
+      }
+
+      ldif_free_record(r);
+      imp->slots[i] = imp->slots[--imp->inflight];
+
+      pumpImport();
+      return 1;
+    }
+
+    return 0;
+  }
+
+  void abortImport(int error)
+  {
+    ldif_import * imp = import_;
+
+    for (int i = 0; i < imp->inflight; i++) {
+      ldif_add_failure(imp, &(imp->slots[i]), error);
+      ldif_free_record(&(imp->slots[i]));
+      imp->failed++;
+    }
+    imp->inflight = 0;
+    imp->aborted = 1;
+
+    finishImport();
+  }
+
+  void finishImport()
+  {
+    HandleScope scope;
+    ldif_import * imp = import_;
+    Local<Object> stats = Object::New();
+    Local<Array> failures = Array::New(imp->nfailures);
+    Handle<Value> args[1];
+    struct timeval now;
+    double elapsed;
+
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - imp->started.tv_sec) * 1000.0 +
+              (now.tv_usec - imp->started.tv_usec) / 1000.0;
+
+    for (int i = 0; i < imp->nfailures; i++) {
+      ldif_failure * f = &(imp->failures[i]);
+      Local<Object> failure = Object::New();
+      failure->Set(String::New("line"), Integer::New(f->line));
+      failure->Set(String::New("dn"), String::New(f->dn));
+      failure->Set(String::New("code"), Integer::New(f->code));
+      failure->Set(String::New("message"), String::New(ldap_err2string(f->code)));
+      failures->Set(Integer::New(i), failure);
+    }
+
+    stats->Set(String::New("records"), Integer::New(imp->count));
+    stats->Set(String::New("succeeded"), Integer::New(imp->succeeded));
+    stats->Set(String::New("failed"), Integer::New(imp->failed));
+    stats->Set(String::New("skipped"),
+               Integer::New(imp->count - imp->succeeded - imp->failed));
+    stats->Set(String::New("aborted"), Boolean::New(imp->aborted));
+    stats->Set(String::New("elapsed"), Number::New(elapsed));
+    stats->Set(String::New("rate"), Number::New(elapsed > 0 ?
+               (imp->succeeded + imp->failed) * 1000.0 / elapsed : 0));
+    stats->Set(String::New("failures"), failures);
+    if (imp->error[0]) {
+      stats->Set(String::New("error"), String::New(imp->error));
+    }
+
+    // detach before emitting, so the listener may start another import
+    import_ = NULL;
+    ldif_free_import(imp);
+
+    args[0] = stats;
+    Emit(symbol_importdone, 1, args);
+  }
+
+
+  void setMode(int msgid, int mode)
+  {
+    if (mode == SEARCH_ENTRIES) return;
+
+    search_mode * m = (search_mode *) malloc(sizeof(search_mode));
+    m->msgid = msgid;
+    m->mode = mode;
+    m->next = modes_;
+    modes_ = m;
+  }
+
+  // Returns (and forgets) the mode msgid was sent with.
+  int takeMode(int msgid)
+  {
+    for (search_mode ** mp = &modes_; *mp; mp = &((*mp)->next)) {
+      search_mode * m = *mp;
+      if (m->msgid == msgid) {
+        int mode = m->mode;
+        *mp = m->next;
+        free(m);
+        return mode;
+      }
+    }
+    return SEARCH_ENTRIES;
+  }
+
+  void clearModes()
+  {
+    while (modes_ != NULL) {
+      search_mode * m = modes_;
+      modes_ = m->next;
+      free(m);
+    }
+  }
+
+  Local<Value> parseDNs(LDAPConnection * c, LDAPMessage * res)
+  {
+    HandleScope scope;
+    LDAPMessage * entry;
+    Local<Array> js_result_list = Array::New();
+    char * dn;
+    int j;
+
+    for (entry = ldap_first_entry(c->ld, res), j = 0 ; entry ;
+         entry = ldap_next_entry(c->ld, entry), j++) {
+      dn = ldap_get_dn(c->ld, entry);
+      js_result_list->Set(Integer::New(j), String::New(dn));
+      ldap_memfree(dn);
+    }
+
+    return scope.Close(js_result_list);
+  }
+
+  // Uses the VLV contentCount when the server sent one, and otherwise
+  // counts the returned entries.
+  Local<Value> parseCount(LDAPConnection * c, LDAPMessage * res)
+  {
+    HandleScope scope;
+    LDAPControl **returnedControls = NULL;
+    LDAPControl *control;
+    struct berval *context = NULL;
+    int targetpos = 0, count = -1, errcode = LDAP_SUCCESS;
+
+    ldap_parse_result(c->ld, res, NULL, NULL, NULL, NULL, &returnedControls, 0);
+
+    control = ldap_control_find(LDAP_CONTROL_VLVRESPONSE, returnedControls, NULL);
+    if (control != NULL &&
+        ldap_parse_vlvresponse_control(c->ld, control, &targetpos, &count,
+                                       &context, &errcode) != LDAP_SUCCESS) {
+      count = -1;
+    }
+
+    if (context != NULL) {
+      ber_bvfree(context);
+    }
+    if (returnedControls != NULL) {
+      ldap_controls_free(returnedControls);
+    }
+
+    if (count < 0) {
+      count = ldap_count_entries(c->ld, res);
+    }
+
+    return scope.Close(Integer::New(count));
+  }
+
+  // Turns a dereference response into { member: [ { dn: ..., cn: [...] } ] }.
+  Local<Object> parseDeref(LDAPDerefRes * dr)
+  {
+    HandleScope scope;
+    Local<Object> js_deref = Object::New();
+
+    for (; dr != NULL; dr = dr->next) {
+      Local<String> derefAttr = String::New(dr->derefAttr);
+      Local<Object> js_entry = Object::New();
+      Local<Array> js_list;
+
+      if (js_deref->Has(derefAttr)) {
+        js_list = Local<Array>::Cast(js_deref->Get(derefAttr));
+      } else {
+        js_list = Array::New();
+        js_deref->Set(derefAttr, js_list);
+      }
+
+      for (LDAPDerefVal * dv = dr->attrVals; dv != NULL; dv = dv->next) {
+        int num_vals = 0;
+        while (dv->vals != NULL && dv->vals[num_vals].bv_val != NULL) num_vals++;
+
+        Local<Array> js_attr_vals = Array::New(num_vals);
+        for (int i = 0; i < num_vals; i++) {
+          js_attr_vals->Set(Integer::New(i),
+                            String::New(dv->vals[i].bv_val, dv->vals[i].bv_len));
+        }
+        js_entry->Set(String::New(dv->type), js_attr_vals);
+      }
+      js_entry->Set(String::New("dn"),
+                    String::New(dr->derefVal.bv_val, dr->derefVal.bv_len));
+      js_list->Set(Integer::New(js_list->Length()), js_entry);
+    }
+
+    return scope.Close(js_deref);
+  }
 
   Local<Value> parseReply(LDAPConnection * c, LDAPMessage * res) 
   {
@@ -659,11 +2025,11 @@ public:
     Local<Array>  js_result_list;
     Local<Object> js_result;
     Local<Array>  js_attr_vals;
+    LDAPControl ** ctrls = NULL;
     int j;
     char * dn;
 
-    int entry_count = ldap_count_entries(c->ld, res);
-    js_result_list = Array::New(entry_count);
+    js_result_list = Array::New();
 
     for (entry = ldap_first_entry(c->ld, res), j = 0 ; entry ;
          entry = ldap_next_entry(c->ld, entry), j++) {
@@ -687,6 +2053,19 @@ public:
       js_result->Set(String::New("dn"), String::New(dn));
       ber_free(berptr,0);
       ldap_memfree(dn);
+
+      // entries dereferenced by the server ride along as a response control
+      if (ldap_get_entry_controls(c->ld, entry, &ctrls) == LDAP_SUCCESS && ctrls != NULL) {
+        LDAPControl * derefControl = ldap_control_find(LDAP_CONTROL_X_DEREF, ctrls, NULL);
+        LDAPDerefRes * drhead = NULL;
+        if (derefControl != NULL &&
+            ldap_parse_derefresponse_control(c->ld, derefControl, &drhead) == LDAP_SUCCESS) {
+          js_result->Set(String::New("deref"), c->parseDeref(drhead));
+          ldap_derefresponse_free(drhead);
+        }
+        ldap_controls_free(ctrls);
+        ctrls = NULL;
+      }
     } // all entries done.
 
     return scope.Close(js_result_list);
@@ -697,7 +2076,7 @@ public:
     HandleScope scope;
     Local<Object> js_result;
     int l_rc, l_errcode;
-    struct berval *context;
+    struct berval *context = NULL;
     LDAPControl **returnedControls = NULL;
     LDAPControl *control = NULL, *sortControl = NULL;
     ber_int_t sortRC = 0;
@@ -716,6 +2095,10 @@ public:
         if(attrInError!= NULL)
           js_result->Set(String::New("sort_attr_error"), String::New(attrInError));
       }
+      if(attrInError != NULL) {
+        ldap_memfree(attrInError);
+        attrInError = NULL;
+      }
       sortControl = NULL;
     }
     
@@ -752,6 +2135,11 @@ public:
       
       js_result->Set(String::New("bv_val"), bv_val);
     }
+
+    if (context != NULL) {
+      ber_bvfree(context);
+      context = NULL;
+    }
     
     control = NULL;
     
@@ -776,6 +2164,7 @@ public:
     int res;
     int msgid;
     int error;
+    int mode;
 
     // not sure if this is neccesary...
     if (!(revents & EV_READ)) {
@@ -791,13 +2180,27 @@ public:
     res = ldap_result(c->ld, LDAP_RES_ANY, 1, &ldap_tv, &ldap_res);
     if (res < 1) {
       if (res < 0) {
+        if (c->import_ != NULL) {
+          c->abortImport(LDAP_SERVER_DOWN);
+        }
+        c->outstanding_ = 0;
+        c->clearModes();
         c->Emit(symbol_disconnected, 0, NULL);
       }
       return;
     }
 
     msgid = ldap_msgid(ldap_res);
+    if (msgid > 0 && c->outstanding_ > 0) {
+      c->outstanding_--;
+    }
     error = ldap_result2error(c->ld, ldap_res, 0);
+    mode = (res == LDAP_RES_SEARCH_RESULT) ? c->takeMode(msgid) : SEARCH_ENTRIES;
+
+    if (c->importResult(msgid, error)) {
+      ldap_msgfree(ldap_res);
+      return;
+    }
 
     args[0] = Integer::New(msgid);
     args[1] = Local<Value>::New(Integer::New(res));
@@ -817,8 +2220,20 @@ public:
         break;
 
       case  LDAP_RES_SEARCH_RESULT:
-        args[3] = c->parsePageControl(c, ldap_res);
-        args[2] = c->parseReply(c, ldap_res);
+        switch (mode) {
+        case SEARCH_COUNT:
+          args[3] = Local<Value>::New(Undefined());
+          args[2] = c->parseCount(c, ldap_res);
+          break;
+        case SEARCH_DN:
+          args[3] = c->parsePageControl(c, ldap_res);
+          args[2] = c->parseDNs(c, ldap_res);
+          break;
+        default:
+          args[3] = c->parsePageControl(c, ldap_res);
+          args[2] = c->parseReply(c, ldap_res);
+          break;
+        }
         c->Emit(symbol_search, 4, args);
         break;
 
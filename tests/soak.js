@@ -0,0 +1,259 @@
+// Long running soak test. Drives every operation, including the error
+// and disconnect paths, against the slapd started by slapd.sh and checks
+// that RSS, the V8 heap and the number of outstanding requests stay flat.
+//
+//   node --expose-gc soak.js [iterations]
+//
+// The iteration count defaults to SOAK_ITERATIONS or one million.
+
+var assert = require('assert');
+var LDAP = require('../LDAP');
+
+var config = {
+  uri: 'ldap://localhost:1234',
+  base: 'ou=soak,dc=sample,dc=com',
+  binddn: 'cn=manager,dc=sample,dc=com',
+  password: 'secret'
+};
+
+var iterations = parseInt(process.argv[2] || process.env.SOAK_ITERATIONS || 1000000, 10);
+var concurrency = 32;
+var fixtures = 10;
+var sampleEvery = Math.max(1, Math.floor(iterations / 20));
+
+// allowed growth between the first sample after warm-up and the end
+var rssSlack = 16 * 1024 * 1024;
+var heapSlack = 8 * 1024 * 1024;
+
+var ldap, binder, victim;
+var binderBusy = false, victimBusy = false;
+var started = 0, finished = 0;
+var baseline = null;
+var samples = [];
+
+function connect(CB) {
+  var cnx = new LDAP.Connection();
+  cnx.querytimeout = 30000;
+  cnx.open(config.uri);
+  cnx.simpleBind(config.binddn, config.password, function(msgId, err) {
+    assert.ok(!err, err);
+    CB(cnx);
+  });
+}
+
+function fixtureDn(i) {
+  return 'cn=fixture' + i + ',' + config.base;
+}
+
+function setup() {
+  connect(function(cnx) {
+    ldap = cnx;
+    binder = new LDAP.Connection();
+    victim = new LDAP.Connection();
+
+    var pending = fixtures + 1;
+    function added(msgId, err) {
+      // 68: left over from an earlier run
+      assert.ok(!err || err.message == '68', err);
+      if (--pending === 0) {
+        run();
+      }
+    }
+
+    ldap.add(config.base, [
+      { type: 'objectClass', vals: ['organizationalUnit'] },
+      { type: 'ou', vals: ['soak'] }
+    ], function(msgId, err) {
+      added(msgId, err);
+      for (var i = 0; i < fixtures; i++) {
+        ldap.add(fixtureDn(i), [
+          { type: 'objectClass', vals: ['person'] },
+          { type: 'cn', vals: ['fixture' + i] },
+          { type: 'sn', vals: ['soak'] }
+        ], added);
+      }
+    });
+  });
+}
+
+// Each operation calls done() exactly once when it has fully completed.
+var operations = [
+  function searchHit(i, done) {
+    ldap.search(config.base, ldap.SUBTREE, 'cn=fixture' + (i % fixtures), '*', function(msgId, err, res) {
+      assert.ok(!err, err);
+      assert.equal(res.length, 1);
+      done();
+    });
+  },
+
+  function searchMiss(i, done) {
+    ldap.search(config.base, ldap.SUBTREE, 'cn=nobody' + i, '*', function(msgId, err, res) {
+      assert.ok(!err, err);
+      assert.equal(res.length, 0);
+      done();
+    });
+  },
+
+  function searchNoSuchBase(i, done) {
+    ldap.search('ou=missing' + i + ',dc=sample,dc=com', ldap.BASE, 'objectClass=*', '*', function(msgId, err) {
+      assert.equal(err.message, '32');
+      done();
+    });
+  },
+
+  function searchDeref(i, done) {
+    ldap.searchDeref(config.base, ldap.ONELEVEL, 'cn=fixture' + (i % fixtures), 'cn sn', ldap.DEREF_ALWAYS, function(msgId, err, res) {
+      assert.ok(!err, err);
+      assert.equal(res.length, 1);
+      done();
+    });
+  },
+
+  function pagedSearch(i, done) {
+    ldap.pagedSearch(config.base, ldap.ONELEVEL, 'cn=fixture*', 'cn', {
+      pageSize: 3,
+      offset: i % fixtures
+    }, function(msgId, err, res, context) {
+      assert.ok(!err, err);
+      assert.ok(context);
+      done();
+    });
+  },
+
+  function addModifyRemove(i, done) {
+    var dn = 'cn=soak' + i + ',' + config.base;
+    ldap.add(dn, [
+      { type: 'objectClass', vals: ['person'] },
+      { type: 'cn', vals: ['soak' + i] },
+      { type: 'sn', vals: ['before'] }
+    ], function(msgId, err) {
+      assert.ok(!err, err);
+      ldap.modify(dn, [
+        { op: 'replace', type: 'sn', vals: ['after'] },
+        { op: 'add', type: 'description', vals: ['soak', 'test'] }
+      ], function(msgId, err) {
+        assert.ok(!err, err);
+        ldap.modifyToMatch(dn, { sn: ['after'], description: ['soak'] }, function(err, mods) {
+          assert.ok(!err, err);
+          assert.equal(mods.length, 1);
+          ldap.remove(dn, function(msgId, err) {
+            assert.ok(!err, err);
+            done();
+          });
+        });
+      });
+    });
+  },
+
+  function modifyMissing(i, done) {
+    ldap.modify('cn=missing' + i + ',' + config.base, [
+      { op: 'replace', type: 'sn', vals: ['x'] }
+    ], function(msgId, err) {
+      assert.equal(err.message, '32');
+      done();
+    });
+  },
+
+  function removeMissing(i, done) {
+    ldap.remove('cn=missing' + i + ',' + config.base, function(msgId, err) {
+      assert.equal(err.message, '32');
+      done();
+    });
+  },
+
+  function bindCycle(i, done) {
+    if (binderBusy) {
+      return operations[0](i, done);
+    }
+    binderBusy = true;
+    binder.open(config.uri);
+    binder.simpleBind(config.binddn, 'wrong' + i, function(msgId, err) {
+      assert.ok(err);
+      binder.simpleBind(config.binddn, config.password, function(msgId, err) {
+        assert.ok(!err, err);
+        binder.close();
+        binderBusy = false;
+        done();
+      });
+    });
+  },
+
+  function disconnectCycle(i, done) {
+    if (victimBusy) {
+      return operations[1](i, done);
+    }
+    victimBusy = true;
+    victim.open(config.uri);
+    victim.simpleBind(config.binddn, config.password, function(msgId, err) {
+      assert.ok(!err, err);
+      victim.search(config.base, victim.BASE, 'objectClass=*', '*', function() {});
+      // drop the connection with the search still outstanding
+      victim.close();
+      assert.equal(victim.outstanding(), 0);
+      victim.remove(fixtureDn(0), function(msgId, err) {
+        assert.ok(err);
+        victimBusy = false;
+        done();
+      });
+    });
+  }
+];
+
+function sample() {
+  if (global.gc) {
+    global.gc();
+  }
+  var mem = process.memoryUsage();
+  var s = {
+    iteration: finished,
+    rss: mem.rss,
+    heapUsed: mem.heapUsed,
+    outstanding: ldap.outstanding()
+  };
+  samples.push(s);
+  console.log(JSON.stringify(s));
+  return s;
+}
+
+function run() {
+  while (started < iterations && started - finished < concurrency) {
+    start(started++);
+  }
+}
+
+function start(i) {
+  operations[i % operations.length](i, function() {
+    finished++;
+    assert.ok(ldap.outstanding() <= concurrency * 2, 'outstanding requests grow: ' + ldap.outstanding());
+
+    if (finished % sampleEvery === 0) {
+      var s = sample();
+      if (baseline === null) {
+        baseline = s; // the first sample ends the warm-up
+      }
+    }
+
+    if (finished === iterations) {
+      // let the last responses and timers settle before measuring
+      setTimeout(check, 1000);
+    } else {
+      process.nextTick(run);
+    }
+  });
+}
+
+function check() {
+  var end = sample();
+  var first = baseline || samples[0];
+
+  assert.equal(end.outstanding, 0, 'requests left outstanding');
+  assert.ok(end.rss - first.rss < rssSlack,
+            'RSS grew by ' + (end.rss - first.rss) + ' bytes');
+  assert.ok(end.heapUsed - first.heapUsed < heapSlack,
+            'V8 heap grew by ' + (end.heapUsed - first.heapUsed) + ' bytes');
+
+  ldap.close();
+  console.warn('soak ' + iterations + ' iterations [OK]');
+}
+
+setup();
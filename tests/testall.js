@@ -541,12 +541,420 @@ function test12() {
       assert.equal(context.offset, offset2);
       ldap.close();
       printOK('test12');
-      done();
+      test13();
       // setTimeout(function () { console.log(555); }, 60000);
     });
   });
 }
 
+// test LDIF import
+function test13() {
+  var fs = require('fs');
+  var file = __dirname + '/import.ldif';
+
+  ldapInit(function(err, cnx) {
+    assert.ok(!err);
+    ldap = cnx;
+    ldap.importLDIF(file, { maxInFlight: 4 }, imported);
+  });
+
+  function imported(err, stats) {
+    assert.ok(!err, deepInspect(stats));
+    assert.equal(stats.records, 8);
+    assert.equal(stats.succeeded, 8);
+    assert.equal(stats.failures.length, 0);
+    ldap.search('ou=import,dc=sample,dc=com', ldap.ONELEVEL, 'objectClass=person', '*', searched);
+  }
+
+  function searched(msgId, err, res) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(res.length, 2);
+    res.sort(function(a, b) { return a.dn < b.dn ? -1 : 1; });
+    assert.equal(res[0].cn[0], 'Import Deux');
+    assert.deepEqual(res[0].sn, ['Deux']);
+    assert.deepEqual(res[1].sn, ['Uno']);
+    assert.deepEqual(res[1].description.sort(), ['folded description', 'modified']);
+
+    // every record conflicts with the first import now
+    ldap.importLDIF(fs.createReadStream(file), { continueOnError: true }, reimported);
+  }
+
+  function reimported(err, stats) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(stats.records, 8);
+    assert.ok(stats.failed > 0);
+    assert.equal(stats.failures[0].line, 4);
+    assert.equal(stats.failures[0].code, 68); // already exists
+
+    ldap.importLDIF(fs.createReadStream(file), abortedImport);
+  }
+
+  function abortedImport(err, stats) {
+    assert.ok(err);
+    assert.ok(stats.aborted);
+    assert.equal(stats.failed, 1);
+
+    ldap.importLDIF(__dirname + '/missing.ldif', missingImport);
+  }
+
+  function missingImport(err, stats) {
+    assert.ok(err);
+    assert.ok(!stats);
+    printOK('test13');
+    test14();
+  }
+}
+
+// test minimal-delta modify
+function test14() {
+  var barbara = 'cn=Barbara Jensen,dc=sample,dc=com';
+  var desired = {
+    cn: ['Barbara Jensen'],
+    sn: ['x1', 'x2', 'x3', 'x4', 'x5', 'x7'],
+    description: 'synced'
+  };
+
+  ldap.modifyToMatch(barbara, desired, modified);
+
+  function modified(err, mods) {
+    assert.ok(!err, deepInspect(err));
+    assert.deepEqual(mods, [
+      { op: 'delete', type: 'sn', vals: ['x6'] },
+      { op: 'add', type: 'sn', vals: ['x7'] },
+      { op: 'add', type: 'description', vals: ['synced'] }
+    ]);
+    // repeated values are the same as one
+    ldap.modifyToMatch(barbara, {
+      sn: desired.sn.concat(['x1']),
+      description: ['synced', 'synced']
+    }, unchanged);
+  }
+
+  function unchanged(err, mods) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(mods.length, 0);
+    ldap.search(barbara, ldap.BASE, 'cn=*', '*', searched);
+  }
+
+  function searched(msgId, err, res) {
+    assert.ok(!err, deepInspect(err));
+    assert.deepEqual(res[0].sn.sort(), desired.sn);
+    ldap.modifyToMatch(barbara, { description: [], sn: ['Jensen'] },
+                       { currentEntry: res[0] }, cleared);
+  }
+
+  function cleared(err, mods) {
+    assert.ok(!err, deepInspect(err));
+    assert.deepEqual(mods, [
+      { op: 'delete', type: 'description', vals: [] },
+      { op: 'replace', type: 'sn', vals: ['Jensen'] }
+    ]);
+    ldap.modifyToMatch(barbara, { sn: ['Jensen'] }, { currentEntry: 'bogus' }, rejected);
+  }
+
+  function rejected(err, mods) {
+    assert.ok(err);
+    assert.ok(!mods);
+    printOK('test14');
+    test15();
+  }
+}
+
+// test coalescing of identical in-flight searches
+function test15() {
+  var waiting = 3;
+  var coalesced = ldap.coalesced;
+  var results = [];
+
+  for (var i = 0; i < waiting; i++) {
+    ldap.search(ldapConfig.base, ldap.SUBTREE, 'cn=Barbara Jensen', '*', searched);
+  }
+  ldap.search(ldapConfig.base, ldap.SUBTREE, 'cn=Barbara Jensen', 'cn', function(msgId, err, res) {
+    assert.ok(!err);
+    assert.ok(!('sn' in res[0]));
+  });
+
+  function searched(msgId, err, res) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(res.length, 1);
+    results.push({ msgId: msgId, res: res });
+
+    if (--waiting === 0) {
+      assert.equal(ldap.coalesced - coalesced, 2);
+      assert.equal(results[0].msgId, results[2].msgId);
+      assert.notStrictEqual(results[0].res, results[1].res);
+      assert.deepEqual(results[0].res, results[1].res);
+
+      // a finished search is not reused
+      ldap.search(ldapConfig.base, ldap.SUBTREE, 'cn=Barbara Jensen', '*', function(msgId, err, res) {
+        assert.ok(!err);
+        assert.notEqual(msgId, results[0].msgId);
+        assert.equal(ldap.coalesced - coalesced, 2);
+        writeBetween();
+      });
+    }
+  }
+
+  // a search sent after a write does not join one sent before it
+  function writeBetween() {
+    var barbara = 'cn=Barbara Jensen,dc=sample,dc=com';
+    var msgIds = [];
+    var waiting = 3;
+
+    function answered(msgId, err) {
+      assert.ok(!err, deepInspect(err));
+      if (--waiting > 0) {
+        return;
+      }
+      assert.notEqual(msgIds[0], msgIds[1]);
+      ldap.modify(barbara, [{ op: 'delete', type: 'description', vals: [] }], function(msgId, err) {
+        assert.ok(!err, deepInspect(err));
+        printOK('test15');
+        test16();
+      });
+    }
+
+    ldap.search(barbara, ldap.BASE, 'objectClass=*', 'description', function(msgId, err) {
+      msgIds[0] = msgId;
+      answered(msgId, err);
+    });
+    ldap.modify(barbara, [
+      { op: 'replace', type: 'description', vals: ['coalesced'] }
+    ], answered);
+    ldap.search(barbara, ldap.BASE, 'objectClass=*', 'description', function(msgId, err) {
+      msgIds[1] = msgId;
+      answered(msgId, err);
+    });
+  }
+}
+
+// test DN-only and count-only searches
+function test16() {
+  var dn = 'ou=tests,dc=sample,dc=com';
+
+  ldap.searchDNs(dn, ldap.ONELEVEL, 'cn=user1*', function(msgId, err, dns) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(dns.length, 11);
+    assert.equal(typeof(dns[0]), 'string');
+    assert.ok(dns.indexOf('cn=user10,' + dn) >= 0);
+
+    ldap.searchCount(dn, ldap.ONELEVEL, 'cn=user*', counted);
+  });
+
+  function counted(msgId, err, count) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(count, 100);
+    ldap.searchCount(dn, ldap.SUBTREE, 'cn=user*', {
+      sortString: 'cn:caseIgnoreOrderingMatch'
+    }, vlvCounted);
+  }
+
+  function vlvCounted(msgId, err, count) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(count, 100);
+    ldap.searchCount(dn, ldap.ONELEVEL, 'cn=nobody', function(msgId, err, count) {
+      assert.ok(!err);
+      assert.strictEqual(count, 0);
+      printOK('test16');
+      test17();
+    });
+  }
+}
+
+// test the dereference control
+function test17() {
+  var group = 'cn=Readers,dc=sample,dc=com';
+
+  ldap.add(group, [
+    { type: 'objectClass',
+      vals: ['groupOfNames'] },
+    { type: 'cn',
+      vals: ['Readers'] },
+    { type: 'member',
+      vals: ['cn=Barbara Jensen,dc=sample,dc=com', 'cn=Manager,dc=sample,dc=com'] }
+  ], added);
+
+  function added(msgId, err) {
+    assert.ok(!err, deepInspect(err));
+    ldap.search(group, ldap.BASE, 'objectClass=*', 'cn member', {
+      derefSpec: { member: ['cn', 'sn'] }
+    }, searched);
+  }
+
+  function searched(msgId, err, res) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(res.length, 1);
+    assert.ok(res[0].deref, deepInspect(res));
+
+    var members = res[0].deref.member;
+    assert.equal(members.length, 2);
+    members.sort(function(a, b) { return a.dn < b.dn ? -1 : 1; });
+    assert.equal(members[0].dn, 'cn=Barbara Jensen,dc=sample,dc=com');
+    assert.deepEqual(members[0].cn, ['Barbara Jensen']);
+    assert.deepEqual(members[0].sn, ['Jensen']);
+    assert.equal(members[1].dn, 'cn=Manager,dc=sample,dc=com');
+    assert.deepEqual(members[1].cn, ['Manager']);
+    assert.ok(!('sn' in members[1]));
+
+    assert.throws(function() {
+      ldap.search(group, ldap.BASE, 'objectClass=*', 'cn', {
+        derefSpec: { member: 'cn' }
+      }, function() {});
+    }, /must be arrays/);
+
+    ldap.search(group, ldap.BASE, 'objectClass=*', 'cn', function(msgId, err, res) {
+      assert.ok(!err);
+      assert.ok(!('deref' in res[0]));
+      printOK('test17');
+      test18();
+    });
+  }
+}
+
+// test the VLV cursor window cache
+function test18() {
+  var dn = 'ou=tests,dc=sample,dc=com';
+  var names = [];
+  for (var i = 0; i < 100; i++) {
+    names.push('user' + i);
+  }
+  names.sort();
+
+  var cursor = ldap.vlvCursor(dn, ldap.SUBTREE, 'cn=user*', 'cn', {
+    sortString: 'cn:caseIgnoreOrderingMatch',
+    windowSize: 10
+  });
+
+  function cns(entries) {
+    return entries.map(function(entry) { return entry.cn[0]; });
+  }
+
+  cursor.get(25, 10, function(err, entries, count) {
+    assert.ok(!err, deepInspect(err));
+    assert.equal(count, 100);
+    assert.deepEqual(cns(entries), names.slice(25, 35));
+    // windows 1 to 3 came back in a single search
+    assert.equal(cursor.fetches, 1);
+
+    // window 4 is being prefetched already
+    cursor.get(40, 5, function(err, entries) {
+      assert.ok(!err, deepInspect(err));
+      assert.deepEqual(cns(entries), names.slice(40, 45));
+      assert.equal(cursor.fetches, 2);
+
+      cursor.get(18, 4, function(err, entries) {
+        assert.ok(!err, deepInspect(err));
+        assert.deepEqual(cns(entries), names.slice(18, 22));
+        assert.equal(cursor.fetches, 2);
+        ldap.add('cn=user100,' + dn, [
+          { type: 'objectClass', vals: ['person'] },
+          { type: 'cn', vals: ['user100'] },
+          { type: 'sn', vals: ['test100'] }
+        ], grown);
+      });
+    });
+  });
+
+  function grown(msgId, err) {
+    assert.ok(!err, deepInspect(err));
+    names.push('user100');
+    names.sort();
+
+    cursor.get(90, 20, function(err, entries, count) {
+      assert.ok(!err, deepInspect(err));
+      assert.equal(count, 101);
+      assert.deepEqual(cns(entries), names.slice(90));
+
+      // the content count changed, so earlier windows were dropped
+      var fetches = cursor.fetches;
+      cursor.get(25, 1, function(err, entries) {
+        assert.ok(!err, deepInspect(err));
+        assert.deepEqual(cns(entries), names.slice(25, 26));
+        assert.ok(cursor.fetches > fetches);
+        ldap.remove('cn=user100,' + dn, function(msgId, err) {
+          assert.ok(!err);
+          printOK('test18');
+          test19();
+        });
+      });
+    });
+  }
+}
+
+// test nested group resolution
+function test19() {
+  var barbara = 'cn=Barbara Jensen,dc=sample,dc=com';
+  var options = { base: ldapConfig.base, memberAttr: 'member' };
+  var groups = [
+    { cn: 'Staff', member: 'cn=Readers,dc=sample,dc=com' },
+    { cn: 'All', member: 'cn=Staff,dc=sample,dc=com' },
+    { cn: 'Loop', member: 'cn=All,dc=sample,dc=com' }
+  ];
+  var pending = groups.length;
+
+  // Readers (from test17) -> Staff -> All <-> Loop
+  groups.forEach(function(group) {
+    ldap.add('cn=' + group.cn + ',dc=sample,dc=com', [
+      { type: 'objectClass', vals: ['groupOfNames'] },
+      { type: 'cn', vals: [group.cn] },
+      { type: 'member', vals: [group.member] }
+    ], added);
+  });
+
+  function added(msgId, err) {
+    assert.ok(!err, deepInspect(err));
+    if (--pending === 0) {
+      ldap.modify('cn=All,dc=sample,dc=com', [
+        { op: 'add', type: 'member', vals: ['cn=Loop,dc=sample,dc=com'] }
+      ], looped);
+    }
+  }
+
+  function looped(msgId, err) {
+    assert.ok(!err, deepInspect(err));
+    ldap.resolveGroups(barbara, options, resolved);
+  }
+
+  function resolved(err, result) {
+    assert.ok(!err, deepInspect(err));
+    assert.deepEqual(result.groups.map(function(dn) { return dn.toLowerCase(); }), [
+      'cn=readers,dc=sample,dc=com',
+      'cn=staff,dc=sample,dc=com',
+      'cn=all,dc=sample,dc=com',
+      'cn=loop,dc=sample,dc=com'
+    ]);
+    assert.equal(result.depth, 5);
+    assert.equal(result.searches, 5);
+    assert.equal(result.cycles.length, 1);
+    assert.ok(!result.truncated);
+
+    ldap.resolveGroups(barbara, options, function(err, cached) {
+      assert.ok(!err);
+      assert.equal(cached.searches, 0);
+      assert.deepEqual(cached.groups, result.groups);
+
+      ldap.resolveGroups(barbara, { base: ldapConfig.base, maxDepth: 2 }, function(err, shallow) {
+        assert.ok(!err);
+        assert.equal(shallow.groups.length, 2);
+        assert.ok(shallow.truncated);
+
+        // stopping just where the chain ends is not a truncation
+        ldap.resolveGroups(barbara, { base: ldapConfig.base, maxDepth: 4 }, function(err, exact) {
+          assert.ok(!err);
+          assert.equal(exact.groups.length, 4);
+          assert.ok(!exact.truncated);
+
+          ldap.resolveGroups(barbara, { maxDepth: 0 }, function(err) {
+            assert.ok(err); // base is required
+            printOK('test19');
+            done();
+          });
+        });
+      });
+    });
+  }
+}
+
 function done() {
   ldap.close();
   console.log('Finish');